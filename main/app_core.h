@@ -0,0 +1,13 @@
+#pragma once
+
+#include "sdkconfig.h"
+
+/* Where our own tasks (button handling, requests, and the transport work
+ * they do) run. The BT controller, Bluedroid, the Wi-Fi task and the
+ * FreeRTOS timer task are all on core 0; with two cores we stay out of
+ * their way. See sdkconfig.defaults.* */
+#if CONFIG_FREERTOS_UNICORE
+#define APP_CORE 0
+#else
+#define APP_CORE 1
+#endif
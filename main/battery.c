@@ -0,0 +1,143 @@
+#include "battery.h"
+#include "beacon.h"
+#include "button.h"
+
+#include "driver/adc.h"
+#include "esp_adc_cal.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+
+#define TAG "Battery"
+
+static const struct operating_profile profiles[] = {
+    [BATTERY_NORMAL] = {
+        .tx_power = ESP_PWR_LVL_P3,
+        .retransmit_ms = RETRANSMIT_TIME_MS,
+        .adv_interval = FAST_ADV_INTERVAL,
+        .sleep_timeout_ms = 10000,
+        .touch_idle_cycle = TOUCH_SLEEP_CYCLE,
+        .touch_deep_cycle = TOUCH_SLEEP_CYCLE_DEEP,
+    },
+    [BATTERY_LOW] = {
+        .tx_power = ESP_PWR_LVL_N3,
+        .retransmit_ms = 50,
+        .adv_interval = FAST_ADV_INTERVAL,
+        .sleep_timeout_ms = 5000,
+        .touch_idle_cycle = TOUCH_SLEEP_CYCLE,
+        .touch_deep_cycle = 0x8000,
+    },
+    [BATTERY_CRITICAL] = {
+        .tx_power = ESP_PWR_LVL_N9,
+        .retransmit_ms = 40,
+        .adv_interval = 0x30,
+        .sleep_timeout_ms = 2000,
+        .touch_idle_cycle = 0x5000,
+        .touch_deep_cycle = 0xA000,
+    },
+};
+
+/* These persist across sleep */
+/* 0 until there's been a plausible reading */
+static RTC_DATA_ATTR int cached_mv;
+static RTC_DATA_ATTR enum battery_level level = BATTERY_NORMAL;
+/* Counts up to BATTERY_REPORT_WAKES; starts there so the first wake reports */
+static RTC_DATA_ATTR int wakes_since_report = BATTERY_REPORT_WAKES;
+
+#ifdef BATTERY_SENSE
+static int sample_mv(void)
+{
+    esp_adc_cal_characteristics_t chars;
+
+    adc1_config_width(ADC_WIDTH_BIT_12);
+    adc1_config_channel_atten(BATTERY_ADC_CHANNEL, ADC_ATTEN_DB_11);
+    esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, 1100, &chars);
+
+    uint32_t raw = 0;
+    for(int i = 0; i < BATTERY_SAMPLES; i++)
+    {
+        raw += adc1_get_raw(BATTERY_ADC_CHANNEL);
+    }
+    raw /= BATTERY_SAMPLES;
+
+    return esp_adc_cal_raw_to_voltage(raw, &chars) * BATTERY_DIVIDER;
+}
+#endif
+
+static enum battery_level pick_level(int mv, enum battery_level current)
+{
+    /* Thresholds for getting out of each level are a bit higher */
+    int low_mv = BATTERY_LOW_MV + (current >= BATTERY_LOW ? BATTERY_HYSTERESIS_MV : 0);
+    int critical_mv = BATTERY_CRITICAL_MV + (current >= BATTERY_CRITICAL ? BATTERY_HYSTERESIS_MV : 0);
+
+    if(mv < critical_mv)
+    {
+        return BATTERY_CRITICAL;
+    }
+    if(mv < low_mv)
+    {
+        return BATTERY_LOW;
+    }
+    return BATTERY_NORMAL;
+}
+
+void battery_init(void)
+{
+#ifdef BATTERY_SENSE
+    int mv = sample_mv();
+#else
+    int mv = 0;
+#endif
+
+    if(mv >= BATTERY_MIN_MV && mv <= BATTERY_MAX_MV)
+    {
+        /* Radio bursts make single readings noisy - smooth across wakes */
+        cached_mv = cached_mv ? (cached_mv * 3 + mv) / 4 : mv;
+    }
+    else if(mv)
+    {
+        ESP_LOGW(TAG, "Ignoring implausible reading of %d mV", mv);
+    }
+    wakes_since_report++;
+
+    /* Never go easy on the radio on the strength of a reading we don't have */
+    enum battery_level new_level = cached_mv ? pick_level(cached_mv, level) : BATTERY_NORMAL;
+    if(new_level != level)
+    {
+        ESP_LOGI(TAG, "Level %d -> %d", level, new_level);
+        level = new_level;
+
+        /* Worth telling someone about straight away */
+        wakes_since_report = BATTERY_REPORT_WAKES;
+    }
+
+    ESP_LOGI(TAG, "Battery %d mV (sampled %d mV), level %d", cached_mv, mv, level);
+
+    const struct operating_profile *p = battery_profile();
+    beacon_set_profile(p->tx_power, p->adv_interval, p->retransmit_ms);
+    button_set_cycles(p->touch_idle_cycle, p->touch_deep_cycle);
+}
+
+int battery_mv(void)
+{
+    return cached_mv;
+}
+
+enum battery_level battery_level(void)
+{
+    return level;
+}
+
+const struct operating_profile *battery_profile(void)
+{
+    return &profiles[level];
+}
+
+bool battery_report_due(void)
+{
+    return cached_mv && wakes_since_report >= BATTERY_REPORT_WAKES;
+}
+
+void battery_reported(void)
+{
+    wakes_since_report = 0;
+}
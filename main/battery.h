@@ -0,0 +1,63 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_bt.h"
+
+/* Define if the board has the battery on GPIO35 through a 1:2 resistor
+ * divider. Without it there's no reading, and the NORMAL profile is used. */
+//#define BATTERY_SENSE
+
+#define BATTERY_ADC_CHANNEL ADC1_CHANNEL_7
+#define BATTERY_DIVIDER 2
+
+/* Readings outside this range mean there's no battery on the pin
+ * (floating, or wired differently) - they're ignored */
+#define BATTERY_MIN_MV 2500
+#define BATTERY_MAX_MV 4500
+
+/* Readings averaged per wake */
+#define BATTERY_SAMPLES 16
+
+/* Profile thresholds. Going back up needs an extra
+ * BATTERY_HYSTERESIS_MV so we don't flap at the boundary. */
+#define BATTERY_LOW_MV 3550
+#define BATTERY_CRITICAL_MV 3350
+#define BATTERY_HYSTERESIS_MV 50
+
+/* Send the battery level every this many wakes */
+#define BATTERY_REPORT_WAKES 50
+
+enum battery_level
+{
+    BATTERY_NORMAL,
+    BATTERY_LOW,
+    BATTERY_CRITICAL
+};
+
+/* How hard to work for a given battery level */
+struct operating_profile
+{
+    esp_power_level_t tx_power;
+    /* BLE burst length per message */
+    int retransmit_ms;
+    uint16_t adv_interval;
+    int sleep_timeout_ms;
+    /* Touch sampling - see button.h */
+    uint16_t touch_idle_cycle;
+    uint16_t touch_deep_cycle;
+};
+
+/* Sample the battery and pick a profile. Call once per wake. */
+void battery_init(void);
+
+/* Last reading, in mV, or 0 if we don't know */
+int battery_mv(void);
+
+enum battery_level battery_level(void);
+
+const struct operating_profile *battery_profile(void);
+
+/* True if the level should go out with the next update */
+bool battery_report_due(void);
+
+/* The level went out; don't send it again for a while */
+void battery_reported(void);
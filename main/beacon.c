@@ -1,4 +1,6 @@
 #include "beacon.h"
+#include "latency.h"
+#include "rf_cal.h"
 
 #include "esp_bt.h"
 #include "esp_gap_ble_api.h"
@@ -7,6 +9,7 @@
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/timers.h"
+#include "esp_timer.h"
 #include <memory.h>
 #include <string.h>
 #include "freertos/semphr.h"
@@ -26,9 +29,66 @@ static esp_ble_adv_params_t ble_adv_params = {
 static SemaphoreHandle_t ble_mutex;
 static bool advertising_on = false;
 
+/* Advertising has actually started (as opposed to just being wanted) */
+static bool adv_running = false;
+
+/* New data is being written while advertising carries on */
+static bool swapping = false;
+
 static TimerHandle_t ble_timer;
 
+/* From the operating profile */
+static esp_power_level_t tx_power = ESP_PWR_LVL_P3;
+static int retransmit_ms = RETRANSMIT_TIME_MS;
+
 static void check_for_next_message(void);
+static void swap_failed(void);
+
+
+/* Latency accounting.
+ * An update is one message going on air; it costs one or more HCI round
+ * trips (command -> GAP event) through the Bluedroid task.
+ * Only one command is outstanding at a time. */
+static int64_t update_start_us;
+static int update_round_trips;
+static int64_t cmd_start_us;
+
+static int total_updates;
+static int total_round_trips;
+static int total_swaps;
+
+static void begin_update(void)
+{
+    update_start_us = esp_timer_get_time();
+    update_round_trips = 0;
+}
+
+static void begin_cmd(void)
+{
+    cmd_start_us = esp_timer_get_time();
+}
+
+static void end_cmd(const char *what)
+{
+    update_round_trips++;
+    ESP_LOGI(TAG, "HCI %s: %lld us", what, esp_timer_get_time() - cmd_start_us);
+}
+
+static void end_update(void)
+{
+    latency_radio();
+
+    total_updates++;
+    total_round_trips += update_round_trips;
+
+    ESP_LOGI(TAG, "On air after %d round trips, %lld us (%d updates, %d swapped in place, %d.%02d round trips avg)",
+             update_round_trips,
+             esp_timer_get_time() - update_start_us,
+             total_updates,
+             total_swaps,
+             total_round_trips / total_updates,
+             (total_round_trips * 100 / total_updates) % 100);
+}
 
 
 static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
@@ -38,11 +98,32 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
 
     switch (event) {
     case ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT:
+        end_cmd("set data");
+
+        if(swapping)
+        {
+            /* New data went in under a running advertisement */
+            swapping = false;
+
+            if ((err = param->adv_data_raw_cmpl.status) != ESP_BT_STATUS_SUCCESS) {
+                ESP_LOGE(TAG, "In-place data swap failed: %d", err);
+                swap_failed();
+                break;
+            }
+
+            end_update();
+            xTimerReset(ble_timer, 0);
+            break;
+        }
+
+        begin_cmd();
         esp_ble_gap_start_advertising(&ble_adv_params);
         ESP_LOGI(TAG, "Starting adv");
 
         break;
     case ESP_GAP_BLE_ADV_START_COMPLETE_EVT:
+        end_cmd("start");
+
         //adv start complete event to indicate adv start successfully or failed
         if ((err = param->adv_start_cmpl.status) != ESP_BT_STATUS_SUCCESS) {
             ESP_LOGE(TAG, "Adv start failed: %s", esp_err_to_name(err));
@@ -50,6 +131,8 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
         else
         {
             ESP_LOGI(TAG, "Started adv successful");
+            adv_running = true;
+            end_update();
         }
 
         /* Reset the 'stop' timer */
@@ -57,6 +140,8 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
 
         break;
     case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
+        end_cmd("stop");
+        adv_running = false;
 
         /* Stop complete. Are we here because we're changing messages or because we're done */
 
@@ -149,28 +234,107 @@ struct set_message
 static struct set_message messages[MAX_MESSAGES];
 static int msg_ptr = 0; // points at the slot after the tail of the queue - where new thing goes
 
+/* Double buffered frames: one on air, one ready to go */
+static esp_ble_ibeacon_t frames[2];
+static int on_air_frame = 0;
 
-static void check_for_next_message(void)
-{
-    ESP_LOGI(TAG, "checking message cache for next dirty message");
+/* Message encoded into the next frame, or -1 if there isn't one */
+static int next_msg_index = -1;
+
+/* Message that went in with the last swap, in case it has to be redone */
+static int swap_msg_index = -1;
+
+/* Controller enabled ahead of any message (beacon_prewarm) */
+static bool warm = false;
+
+/* Frame encoded ahead of time for the message we expect */
+static struct set_message predicted;
+static esp_ble_ibeacon_t predicted_frame;
+static bool predicted_valid = false;
 
-    int msg_index = -1;
 
+static int first_dirty_message(void)
+{
     for(int i = 0; i < MAX_MESSAGES; i++)
     {
         if(messages[i].dirty)
         {
-            /* Do this one */
-            messages[i].dirty = false;
-            msg_index = i;
-            break;
+            return i;
         }
     }
+    return -1;
+}
+
+static esp_err_t encode_message(const struct set_message *msg, esp_ble_ibeacon_t *frame)
+{
+    esp_err_t status = esp_ble_config_ibeacon_data (&vendor_config, frame);
+
+    char *uuid = (char*)frame->ibeacon_vendor.proximity_uuid;
+    memcpy(uuid, &msg->value, 4);
+    strcpy(uuid + 4, msg->name);
+
+    return status;
+}
+
+/* Which gesture this is, and when it started (ms, wrapping).
+ * Done as the frame is sent, not when it's encoded - a predicted frame
+ * is encoded before debounce has started the new gesture's trace. */
+static void stamp_trace(esp_ble_ibeacon_t *frame)
+{
+#ifdef LATENCY_IN_FRAMES
+    const struct latency_trace *lat = latency_current();
+    frame->ibeacon_vendor.major = ENDIAN_CHANGE_U16(lat->gesture_id);
+    frame->ibeacon_vendor.minor = ENDIAN_CHANGE_U16((uint16_t)(lat->t_touch / 1000));
+#endif
+}
+
+static esp_err_t encode_frame(int msg_index, esp_ble_ibeacon_t *frame)
+{
+    esp_err_t status = ESP_OK;
+
+    if(predicted_valid &&
+       predicted.value == messages[msg_index].value &&
+       !strcmp(predicted.name, messages[msg_index].name))
+    {
+        /* Guessed right - it's already done */
+        ESP_LOGI(TAG, "Using predicted frame");
+        predicted_valid = false;
+        memcpy(frame, &predicted_frame, sizeof(*frame));
+    }
+    else
+    {
+        status = encode_message(&messages[msg_index], frame);
+    }
+
+    stamp_trace(frame);
+    return status;
+}
+
+/* Encode the next dirty message into the spare frame,
+ * so the swap is just a hand-over when its turn comes */
+static void prepare_next_frame(void)
+{
+    next_msg_index = first_dirty_message();
+
+    if(next_msg_index != -1 &&
+       encode_frame(next_msg_index, &frames[1 - on_air_frame]) != ESP_OK)
+    {
+        next_msg_index = -1;
+    }
+}
+
+static void check_for_next_message(void)
+{
+    ESP_LOGI(TAG, "checking message cache for next dirty message");
+
+    int msg_index = first_dirty_message();
 
     if(msg_index == -1)
     {
         /* nothing to do */
         advertising_on = false;
+        next_msg_index = -1;
+        warm = false;
 
         /* Stop bluetooth */
         ESP_LOGI(TAG, "Shutting down bluetooth");
@@ -179,43 +343,94 @@ static void check_for_next_message(void)
         return;
     }
 
+    /* Do this one */
+    messages[msg_index].dirty = false;
+
     ESP_LOGI(TAG, "Start adv message: %s=%d", messages[msg_index].name, messages[msg_index].value);
 
 
     if(!advertising_on)
     {
-        ESP_LOGI(TAG, "Enabling bluetooth");
-        esp_bt_controller_enable(ESP_BT_MODE_BLE);
+        begin_update();
+
+        if(warm)
+        {
+            ESP_LOGI(TAG, "Bluetooth already warm");
+        }
+        else
+        {
+            ESP_LOGI(TAG, "Enabling bluetooth");
+            esp_bt_controller_enable(ESP_BT_MODE_BLE);
+            esp_ble_tx_power_set(ESP_BLE_PWR_TYPE_ADV, tx_power);
+        }
         advertising_on = true;
+        warm = false;
     }
 
     /* Set up the new data */
-    esp_ble_ibeacon_t ibeacon_adv_data;
-    esp_err_t status = esp_ble_config_ibeacon_data (&vendor_config, &ibeacon_adv_data);
-
-    char *uuid = (char*)ibeacon_adv_data.ibeacon_vendor.proximity_uuid;
-    memcpy(uuid, &messages[msg_index].value, 4);
-    strcpy(uuid + 4, messages[msg_index].name);
+    on_air_frame = 1 - on_air_frame;
+    esp_err_t status = encode_frame(msg_index, &frames[on_air_frame]);
 
     if (status == ESP_OK) {
-        esp_ble_gap_config_adv_data_raw((uint8_t*)&ibeacon_adv_data, sizeof(ibeacon_adv_data));
+        begin_cmd();
+        esp_ble_gap_config_adv_data_raw((uint8_t*)&frames[on_air_frame], sizeof(esp_ble_ibeacon_t));
     }
     else {
         ESP_LOGE(TAG, "Config iBeacon data failed: %s\n", esp_err_to_name(status));
     }
+
+    prepare_next_frame();
+}
+
+/* The controller wouldn't take new data mid-advertisement.
+ * Put the message back and do it the slow way. */
+static void swap_failed(void)
+{
+    if(swap_msg_index != -1)
+    {
+        messages[swap_msg_index].dirty = true;
+        swap_msg_index = -1;
+    }
+
+    begin_cmd();
+    esp_ble_gap_stop_advertising();
 }
 
 
-/* Fires when we should go quiet after no new activity */
+/* Fires when the current message has had its air time */
 static void ble_timer_callback(TimerHandle_t xTimer)
 {
     ESP_LOGI(TAG, "BLE Timer");
 
-    if(advertising_on)
+    assert(xSemaphoreTake(ble_mutex, portMAX_DELAY) == pdTRUE);
+
+    if(adv_running && !swapping && next_msg_index != -1)
+    {
+        /* There's a frame ready - swap it in without stopping */
+        ESP_LOGI(TAG, "Swap adv message: %s=%d",
+                 messages[next_msg_index].name, messages[next_msg_index].value);
+
+        messages[next_msg_index].dirty = false;
+        swap_msg_index = next_msg_index;
+        on_air_frame = 1 - on_air_frame;
+
+        begin_update();
+        begin_cmd();
+        swapping = true;
+        total_swaps++;
+        esp_ble_gap_config_adv_data_raw((uint8_t*)&frames[on_air_frame], sizeof(esp_ble_ibeacon_t));
+
+        prepare_next_frame();
+    }
+    else if(advertising_on && !swapping)
     {
-        /* Stop broadcasting the current message */
+        /* Nothing new - stop broadcasting the current message */
+        begin_update();
+        begin_cmd();
         esp_ble_gap_stop_advertising();
     }
+
+    xSemaphoreGive(ble_mutex);
 }
 
 void beacon_init(void)
@@ -223,7 +438,12 @@ void beacon_init(void)
     esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
     esp_bt_controller_init(&bt_cfg);
 
+    /* This is where the PHY gets calibrated (or not) */
+    int64_t t_enable = esp_timer_get_time();
     esp_bt_controller_enable(ESP_BT_MODE_BLE);
+    rf_cal_radio_started(esp_timer_get_time() - t_enable);
+    esp_ble_tx_power_set(ESP_BLE_PWR_TYPE_ADV, tx_power);
+    warm = true;
     esp_bluedroid_init();
     esp_bluedroid_enable();
     esp_err_t status;
@@ -242,13 +462,59 @@ void beacon_init(void)
 
 
     ble_timer = xTimerCreate("BLE Timer",
-                             pdMS_TO_TICKS(RETRANSMIT_TIME_MS),
+                             pdMS_TO_TICKS(retransmit_ms),
                              0, // No autoreload
                              0, // Timer ID = 0
                              ble_timer_callback // Callback fn
         );
 }
 
+void beacon_set_profile(esp_power_level_t power, uint16_t adv_interval, int burst_ms)
+{
+    tx_power = power;
+    ble_adv_params.adv_int_min = adv_interval;
+    ble_adv_params.adv_int_max = adv_interval;
+    retransmit_ms = burst_ms;
+}
+
+void beacon_prewarm(char *name, int value)
+{
+    assert(xSemaphoreTake(ble_mutex, portMAX_DELAY) == pdTRUE);
+
+    if(!advertising_on && !warm)
+    {
+        int64_t t_enable = esp_timer_get_time();
+        esp_bt_controller_enable(ESP_BT_MODE_BLE);
+        esp_ble_tx_power_set(ESP_BLE_PWR_TYPE_ADV, tx_power);
+        warm = true;
+        ESP_LOGI(TAG, "Pre-warmed in %lld us", esp_timer_get_time() - t_enable);
+    }
+
+    strncpy(predicted.name, name, sizeof(predicted.name) - 1);
+    predicted.name[sizeof(predicted.name) - 1] = '\0';
+    predicted.value = value;
+    predicted_valid = (encode_message(&predicted, &predicted_frame) == ESP_OK);
+
+    xSemaphoreGive(ble_mutex);
+}
+
+void beacon_prewarm_cancel(void)
+{
+    assert(xSemaphoreTake(ble_mutex, portMAX_DELAY) == pdTRUE);
+
+    predicted_valid = false;
+
+    if(warm && !advertising_on)
+    {
+        /* Nothing went on air - the controller was only on for us */
+        ESP_LOGI(TAG, "Pre-warm cancelled");
+        esp_bt_controller_disable();
+    }
+    warm = false;
+
+    xSemaphoreGive(ble_mutex);
+}
+
 void beacon_set_int_var(char *name, int value)
 {
     assert(xSemaphoreTake(ble_mutex, portMAX_DELAY) == pdTRUE);
@@ -284,11 +550,8 @@ void beacon_set_int_var(char *name, int value)
         {
             /* This value has changed */
             messages[msg_index].value = value;
-            if(!messages[msg_index].dirty)
-            {
-                dirtied = true;
-                messages[msg_index].dirty = true;
-            }
+            messages[msg_index].dirty = true;
+            dirtied = true;
 
             ESP_LOGI(TAG, "Updated message, marked dirty");
         }
@@ -310,6 +573,11 @@ void beacon_set_int_var(char *name, int value)
         /* Start advertising again */
         check_for_next_message();
     }
+    else if(dirtied)
+    {
+        /* Have it ready for when the current message is done */
+        prepare_next_frame();
+    }
 
     xSemaphoreGive(ble_mutex);
 }
@@ -1,4 +1,5 @@
 
+#include "esp_bt.h"
 
 /* Approx 20ms */
 #define FAST_ADV_INTERVAL 0x20
@@ -12,3 +13,15 @@
 void beacon_init(void);
 
 void beacon_set_int_var(char *name, int value);
+
+/* A message is probably coming (finger down).
+ * Get the controller going and encode the likely frame now,
+ * so that when it does come it only has to be handed over. */
+void beacon_prewarm(char *name, int value);
+
+/* It didn't come. Turn the controller back off if nothing else needs it. */
+void beacon_prewarm_cancel(void);
+
+/* Trade range and redundancy for battery life.
+ * Call before beacon_init(). */
+void beacon_set_profile(esp_power_level_t tx_power, uint16_t adv_interval, int retransmit_ms);
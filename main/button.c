@@ -1,4 +1,7 @@
 #include "button.h"
+#include "app_core.h"
+#include "latency.h"
+#include "wake_stub.h"
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -7,41 +10,102 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <esp_log.h>
+#include <esp_attr.h>
+#include <esp_timer.h>
 
 #define TAG "Button"
 
-/* Active whenever the button is pushed */
-static TimerHandle_t debounce_timer;
+/* Debounces, and times holds and the rate holdoff.
+ * The ISR wakes it with a notification. */
+static TaskHandle_t button_task;
 
-static bool last_button_reading = false;
+/* Next debounce pass - active whenever any button is pushed */
+static bool debounce_pending = false;
+static TickType_t debounce_at;
 
-/* When did the current button hold start */
-static uint64_t hold_start_ms;
+/* Everything we know about one pad. All pads are updated
+ * together in one debounce pass of the button task. */
+struct pad_state
+{
+    uint8_t id;
+    bool pressed;
+    uint16_t threshold;
+    /* Untouched reading, or 0 if we don't know it yet */
+    uint16_t baseline;
+    /* Debounce passes to leave out of the baseline - a finger
+     * that just left can still be pulling the reading down */
+    uint8_t baseline_holdoff;
+    /* When did the current hold start */
+    uint32_t hold_start_ms;
+};
+
+static const struct
+{
+    uint8_t id;
+    uint16_t threshold;
+} pad_config[BUTTON_COUNT] = BUTTON_PADS;
+
+static struct pad_state pads[BUTTON_COUNT];
+
+/* Group mask of all our pads */
+static uint16_t pad_mask;
+
+/* Pads the button task is looking after (pressed, or waiting to be
+ * confirmed) - the ISR ignores these. Bits are pad ids, not indexes. */
+static uint16_t tracked_mask;
+/* Pads the ISR has just started tracking, for button_touch_event() */
+static uint16_t touched_mask;
+static portMUX_TYPE button_mux = portMUX_INITIALIZER_UNLOCKED;
 
 static int isr_calls = 0;
 
-static bool ignore_intr = false;
+/* When the ISR first saw the current press */
+static int64_t isr_time_us;
+
+/* Drops us back to the idle rate after a while with no presses */
+static bool rate_pending = false;
+static TickType_t rate_at;
+
+static enum touch_rate current_rate = -1;
+
+/* Can be changed by the operating profile */
+static uint16_t idle_cycle = TOUCH_SLEEP_CYCLE;
+static uint16_t deep_cycle = TOUCH_SLEEP_CYCLE_DEEP;
+
+/* The deep sleep cycle in effect when we last went to sleep */
+static RTC_DATA_ATTR uint16_t slept_with_cycle;
+
+/* Baselines survive deep sleep, so a pad that wakes us
+ * already has a sensible threshold */
+static RTC_DATA_ATTR uint16_t saved_baselines[BUTTON_COUNT];
 
 static void button_isr(void *arg)
 {
-    /* Gets called repeatedly while touch pad is pushed */
+    /* Gets called repeatedly while a touch pad is pushed */
     isr_calls++;
+    uint32_t status = touch_pad_get_status();
     touch_pad_clear_status();
 
-    /* (re)start the debounce timer */
+    portENTER_CRITICAL_ISR(&button_mux);
 
-    if(ignore_intr)
+    /* We know about pads being pushed already;
+     * they're being handled by the button task now */
+    uint16_t fresh = status & pad_mask & ~tracked_mask;
+    tracked_mask |= fresh;
+    touched_mask |= fresh;
+
+    portEXIT_CRITICAL_ISR(&button_mux);
+
+    if(!fresh)
     {
-        /* We know we're being pushed.
-         * being handled by the debounce timer now
-         */
         return;
     }
 
-    ignore_intr = true;
+    isr_time_us = esp_timer_get_time();
 
-    int yield;
-    xTimerResetFromISR(debounce_timer, &yield);
+    /* Have the button task (re)start debouncing */
+    BaseType_t yield = pdFALSE;
+    vTaskNotifyGiveFromISR(button_task, &yield);
 
     if(yield)
     {
@@ -49,79 +113,317 @@ static void button_isr(void *arg)
     }
 }
 
-/* Check if any buttons are pushed */
-static int button_pushed()
+static void set_threshold(struct pad_state *p)
+{
+    p->threshold = p->baseline ?
+        p->baseline * TOUCH_THRESHOLD_PERCENT / 100 :
+        pad_config[p - pads].threshold;
+}
+
+static uint16_t read_pad(struct pad_state *p)
 {
-    uint16_t touch_filter_value;
-    //touch_pad_read_filtered(TOUCH_PAD_ID, &touch_filter_value);
-    touch_pad_read(TOUCH_PAD_ID, &touch_filter_value);
-    ESP_LOGI(TAG, "touch pad value: %d", touch_filter_value);
-    return touch_filter_value < TOUCH_THRESHOLD;
+    uint16_t touch_value;
+    //touch_pad_read_filtered(p->id, &touch_value);
+    touch_pad_read(p->id, &touch_value);
+    return touch_value;
 }
 
 
-/* This is called by the debounce timer. */
+/* This is called by the debug timer. */
 static void debug_callback(TimerHandle_t xTimer)
 {
-    button_pushed();
+    for(int i = 0; i < BUTTON_COUNT; i++)
+    {
+        ESP_LOGI(TAG, "touch pad %d value: %d (baseline %d, threshold %d)",
+                 pads[i].id, read_pad(&pads[i]), pads[i].baseline, pads[i].threshold);
+    }
     ESP_LOGI(TAG, "ISR calls: %d", isr_calls);
 }
 
-/* This is called by the debounce timer. */
-static void debounce_callback(TimerHandle_t xTimer)
+static void start_debounce(void)
 {
-    bool pushed_now = button_pushed();
-    //bool pushed_now = touch_pad_get_status();
+    debounce_at = xTaskGetTickCount() + pdMS_TO_TICKS(DEBOUNCE_MS);
+    debounce_pending = true;
+}
 
-    uint64_t hold_time = pdTICKS_TO_MS(xTaskGetTickCount()) - hold_start_ms;
+static void start_rate_holdoff(void)
+{
+    rate_at = xTaskGetTickCount() + pdMS_TO_TICKS(TOUCH_ACTIVE_HOLDOFF_MS);
+    rate_pending = true;
+}
 
-    ESP_LOGI(TAG, "%d -> %d", last_button_reading, pushed_now);
+/* Called by the button task, DEBOUNCE_MS after a touch and then every
+ * DEBOUNCE_MS while anything is pushed. */
+static void debounce(void)
+{
+    uint32_t now_ms = pdTICKS_TO_MS(xTaskGetTickCount());
+
+    portENTER_CRITICAL(&button_mux);
+    uint16_t tracked = tracked_mask;
+    portEXIT_CRITICAL(&button_mux);
+
+    /* Pads we're done with - the ISR can have them back */
+    uint16_t released = 0;
+    bool any_pressed = false;
 
-    if(!last_button_reading && pushed_now)
+    for(int i = 0; i < BUTTON_COUNT; i++)
     {
-        hold_start_ms = pdTICKS_TO_MS(xTaskGetTickCount());
-        last_button_reading = true;
+        struct pad_state *p = &pads[i];
+        uint16_t value = read_pad(p);
+        bool pushed_now = value < p->threshold;
+
+        uint32_t hold_time = now_ms - p->hold_start_ms;
+
+        if(!p->pressed && pushed_now)
+        {
+            /* Rising edge */
+            p->hold_start_ms = now_ms;
+            p->pressed = true;
+
+            ESP_LOGI(TAG, "pad %d: press confirmed %lld us after interrupt",
+                     p->id, esp_timer_get_time() - isr_time_us);
+            latency_touch(isr_time_us, false);
+            latency_down();
+
+            /* Track the press closely */
+            rate_pending = false;
+            button_set_rate(TOUCH_RATE_ACTIVE);
+
+            button_down_event(i);
+        }
+        else if(p->pressed && !pushed_now)
+        {
+            /* Falling edge */
+            p->pressed = false;
+
+            button_up_event(i, hold_time);
+
+            released |= 1 << p->id;
+        }
+        else if(p->pressed && pushed_now)
+        {
+            /* Still pushed */
+            button_hold_event(i, hold_time);
+        }
+        else
+        {
+            /* Not pushed - a blip if the ISR thought it was */
+            if((1 << p->id) & tracked)
+            {
+                released |= 1 << p->id;
+                button_blip_event(i);
+
+                /* This reading, and the next */
+                p->baseline_holdoff = 2;
+            }
+
+            /* Follow slow drift in the untouched reading
+             * (0 means the pad hasn't been measured yet) */
+            if(p->baseline_holdoff)
+            {
+                p->baseline_holdoff--;
+            }
+            else if(value)
+            {
+                p->baseline = p->baseline ? (p->baseline * 15 + value) / 16 : value;
+                set_threshold(p);
+                touch_pad_set_thresh(p->id, p->threshold);
+            }
+        }
+
+        any_pressed |= p->pressed;
+    }
 
-        /* Rising edge */
-        button_down_event();
+    portENTER_CRITICAL(&button_mux);
+    tracked_mask &= ~released;
+    portEXIT_CRITICAL(&button_mux);
 
-        xTimerReset(debounce_timer, 0);
+    if(any_pressed)
+    {
+        /* Keep watching */
+        start_debounce();
     }
-    else if (last_button_reading && !pushed_now)
+    else
     {
-        /* Falling edge */
-        last_button_reading = false;
-
-        button_up_event(hold_time);
+        start_rate_holdoff();
+    }
+}
 
-        ignore_intr = false;
+static uint16_t rate_cycle(enum touch_rate rate)
+{
+    switch(rate)
+    {
+    case TOUCH_RATE_DEEP_SLEEP:
+        return deep_cycle;
+    case TOUCH_RATE_ACTIVE:
+        return TOUCH_SLEEP_CYCLE_ACTIVE;
+    case TOUCH_RATE_IDLE:
+    default:
+        return idle_cycle;
     }
-    else if(last_button_reading && pushed_now)
+}
+
+void button_set_rate(enum touch_rate rate)
+{
+    if(rate == current_rate)
     {
-        /* Still pushed */
-        button_hold_event(hold_time);
+        return;
+    }
+
+    uint16_t cycle = rate_cycle(rate);
+    touch_pad_set_meas_time(cycle, TOUCH_PAD_MEASURE_CYCLE_DEFAULT);
+    current_rate = rate;
+
+    ESP_LOGI(TAG, "touch rate %d: cycle 0x%x (~%d ms)", rate, cycle, TOUCH_SLEEP_CYCLE_TO_MS(cycle));
+}
 
-        xTimerReset(debounce_timer, 0);
+/* Called by the button task when things have gone quiet */
+static void rate_holdoff_expired(void)
+{
+    for(int i = 0; i < BUTTON_COUNT; i++)
+    {
+        if(pads[i].pressed)
+        {
+            return;
+        }
     }
-    else
+
+    button_set_rate(TOUCH_RATE_IDLE);
+}
+
+/* Ticks until 'at', or 0 if it's already passed */
+static TickType_t ticks_until(TickType_t at)
+{
+    int32_t left = (int32_t)(at - xTaskGetTickCount());
+    return left > 0 ? left : 0;
+}
+
+static void button_task_fn(void *arg)
+{
+    for(;;)
     {
-        /* Blip - ignore */
-        ignore_intr = false;
+        TickType_t wait = portMAX_DELAY;
+        if(debounce_pending)
+        {
+            wait = ticks_until(debounce_at);
+        }
+        if(rate_pending && ticks_until(rate_at) < wait)
+        {
+            wait = ticks_until(rate_at);
+        }
+
+        if(ulTaskNotifyTake(pdTRUE, wait))
+        {
+            /* The ISR saw a new touch - debounce from now */
+            start_debounce();
+
+            portENTER_CRITICAL(&button_mux);
+            uint16_t touched = touched_mask;
+            touched_mask = 0;
+            portEXIT_CRITICAL(&button_mux);
+
+            for(int i = 0; i < BUTTON_COUNT; i++)
+            {
+                if(touched & (1 << pads[i].id))
+                {
+                    button_touch_event(i);
+                }
+            }
+            continue;
+        }
+
+        if(debounce_pending && ticks_until(debounce_at) == 0)
+        {
+            debounce_pending = false;
+            debounce();
+        }
+
+        if(rate_pending && ticks_until(rate_at) == 0)
+        {
+            rate_pending = false;
+            rate_holdoff_expired();
+        }
     }
 }
 
+void button_set_cycles(uint16_t idle, uint16_t deep)
+{
+    idle_cycle = idle;
+    deep_cycle = deep;
+}
 
-void button_init(bool pushed_on)
+void button_prepare_sleep(void)
 {
+    button_set_rate(TOUCH_RATE_DEEP_SLEEP);
+    slept_with_cycle = deep_cycle;
 
-    /* Debouncing stuff */
-    debounce_timer = xTimerCreate("Debounce Timer",
-                                  pdMS_TO_TICKS(DEBOUNCE_MS), // 200ms
-                                  0, // No autoreload
-                                  0, // Timer ID = 0
-                                  debounce_callback // Callback fn
-        );
+    uint8_t ids[BUTTON_COUNT];
+    uint16_t thresholds[BUTTON_COUNT];
+
+    for(int i = 0; i < BUTTON_COUNT; i++)
+    {
+        saved_baselines[i] = pads[i].baseline;
+        ids[i] = pads[i].id;
+        thresholds[i] = pads[i].threshold;
+    }
+
+    /* So the wake stub can throw away wakes that aren't real touches */
+    wake_stub_configure(ids, thresholds, BUTTON_COUNT, deep_cycle);
+}
 
+/* Take the untouched readings from several measurements rather than
+ * trusting whatever the first one happens to be. The FSM must be in
+ * software mode, so each read is a fresh measurement.
+ * Call only when nobody is touching us. */
+static void seed_baselines(void)
+{
+    for(int i = 0; i < BUTTON_COUNT; i++)
+    {
+        struct pad_state *p = &pads[i];
+        uint32_t sum = 0;
+        int n = 0;
+
+        for(int s = 0; s < BUTTON_SEED_SAMPLES; s++)
+        {
+            uint16_t value = read_pad(p);
+
+            /* Not measured, or a finger after all - the debounce
+             * passes will pick the baseline up later */
+            if(!value || value < p->threshold)
+            {
+                n = 0;
+                break;
+            }
+
+            sum += value;
+            n++;
+        }
+
+        if(n)
+        {
+            p->baseline = sum / n;
+            set_threshold(p);
+            touch_pad_set_thresh(p->id, p->threshold);
+        }
+
+        ESP_LOGI(TAG, "pad %d: baseline %d from %d readings, threshold %d",
+                 p->id, p->baseline, n, p->threshold);
+    }
+}
+
+void button_init(int woke_pad)
+{
+    pad_mask = 0;
+    for(int i = 0; i < BUTTON_COUNT; i++)
+    {
+        pads[i].id = pad_config[i].id;
+        pads[i].pressed = false;
+        pads[i].baseline = saved_baselines[i];
+        set_threshold(&pads[i]);
+        pad_mask |= 1 << pads[i].id;
+    }
+
+    bool pushed_on = (woke_pad < TOUCH_PAD_MAX) && (pad_mask & (1 << woke_pad));
 
     /* Debouncing stuff */
     TimerHandle_t debug = xTimerCreate("Debug Timer",
@@ -137,26 +439,59 @@ void button_init(bool pushed_on)
     if(pushed_on)
     {
         /* We were woken by a push! */
+        ESP_LOGI(TAG, "woken by touch: sampled every ~%d ms while asleep, %lld ms since boot, %d false wakes rejected",
+                 TOUCH_SLEEP_CYCLE_TO_MS(slept_with_cycle),
+                 esp_timer_get_time() / 1000,
+                 wake_stub_rejected());
+
         touch_pad_clear_status();
-        ignore_intr = true;
-        hold_start_ms = pdTICKS_TO_MS(xTaskGetTickCount());
-        last_button_reading = true;
-        xTimerReset(debounce_timer, 0);
+        isr_time_us = esp_timer_get_time();
+        latency_touch(isr_time_us, true);
+
+        /* The wake stub has already confirmed it */
+        latency_down();
+        tracked_mask = 1 << woke_pad;
+
+        for(int i = 0; i < BUTTON_COUNT; i++)
+        {
+            if(pads[i].id == woke_pad)
+            {
+                pads[i].hold_start_ms = pdTICKS_TO_MS(xTaskGetTickCount());
+                pads[i].pressed = true;
+                button_touch_event(i);
+            }
+        }
+        start_debounce();
     }
 
+    /* Before the ISR can notify it */
+    xTaskCreatePinnedToCore(&button_task_fn, "button_task", 4096, NULL,
+                            BUTTON_TASK_PRIORITY, &button_task, APP_CORE);
+
     /* Touch Pad */
     touch_pad_init();
-    touch_pad_set_fsm_mode(TOUCH_FSM_MODE_TIMER);
+    touch_pad_set_fsm_mode(TOUCH_FSM_MODE_SW);
 
     // Lowest voltage range possible cuz batteries suck
     touch_pad_set_voltage(TOUCH_HVOLT_2V4, TOUCH_LVOLT_0V8, TOUCH_HVOLT_ATTEN_1V);
-    touch_pad_config(TOUCH_PAD_ID, TOUCH_THRESHOLD);
+    for(int i = 0; i < BUTTON_COUNT; i++)
+    {
+        touch_pad_config(pads[i].id, pads[i].threshold);
+    }
     touch_pad_set_trigger_mode(TOUCH_TRIGGER_BELOW);
+
+    if(!pushed_on)
+    {
+        seed_baselines();
+    }
+    touch_pad_set_fsm_mode(TOUCH_FSM_MODE_TIMER);
     //touch_pad_filter_start(20); // 20ms filter
-    touch_pad_set_group_mask(1 << TOUCH_PAD_ID, 0, 1 << TOUCH_PAD_ID);
 
-    // Make the sleep cycle long
-    touch_pad_set_meas_time(TOUCH_SLEEP_CYCLE, TOUCH_PAD_MEASURE_CYCLE_DEFAULT);
+    // Any of our pads can wake us or interrupt
+    touch_pad_set_group_mask(pad_mask, 0, pad_mask);
+
+    // Sample fast if someone's touching us, otherwise at the idle rate
+    button_set_rate(pushed_on ? TOUCH_RATE_ACTIVE : TOUCH_RATE_IDLE);
 
     touch_trigger_src_t src;
     touch_pad_get_trigger_source(&src);
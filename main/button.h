@@ -6,19 +6,78 @@
 #define TOUCH_THRESHOLD 420
 //#define TOUCH_THRESHOLD 1000
 
+/* Pads we scan, with the threshold to use until we have a baseline.
+ * Events refer to pads by their index in this list. */
+#define BUTTON_PADS { { TOUCH_PAD_ID, TOUCH_THRESHOLD } }
+#define BUTTON_COUNT 1
+
+/* Once we know a pad's untouched reading, it's pushed
+ * when it reads below this percentage of it */
+#define TOUCH_THRESHOLD_PERCENT 70
+
+/* Readings averaged into a pad's baseline at button_init(),
+ * unless a touch woke us */
+#define BUTTON_SEED_SAMPLES 4
+
 // With 150kHz osc:
+// 0x0800 = 14ms
 // 0x1000 = 27ms
+// 0x5000 = 136ms
 // 0xA000 = 270ms
 // 0x3555 = 90ms
+#define TOUCH_SLEEP_CYCLE_TO_MS(c) ((c) / 150)
+
+/* Awake, nothing happening */
 #define TOUCH_SLEEP_CYCLE 0x3555
 
+/* In deep sleep - this is also the worst case wake latency */
+#define TOUCH_SLEEP_CYCLE_DEEP 0x5000
+
+/* While a press is being tracked, and for a while after */
+#define TOUCH_SLEEP_CYCLE_ACTIVE 0x0800
+
+/* Stay at the active rate this long after a release,
+ * in case another tap is coming */
+#define TOUCH_ACTIVE_HOLDOFF_MS 2000
+
+enum touch_rate
+{
+    TOUCH_RATE_DEEP_SLEEP,
+    TOUCH_RATE_IDLE,
+    TOUCH_RATE_ACTIVE
+};
+
 /* Time to debounce an input - also the hold interval */
 #define DEBOUNCE_MS 100
 
-void button_down_event(void);
-void button_up_event(uint64_t hold_ms);
-void button_hold_event(uint64_t hold_ms);
+/* Debounce runs on its own task on APP_CORE rather than in the timer
+ * task, which shares core 0 with the BT and Wi-Fi stacks.
+ * The events below are called from it. */
+#define BUTTON_TASK_PRIORITY 10
+
+/* A touch has been seen, but not debounced yet - called straight away,
+ * for getting anything slow started. Either button_down_event() or
+ * button_blip_event() follows. */
+void button_touch_event(int pad);
+/* The touch didn't last: no down or up will come of it */
+void button_blip_event(int pad);
+
+void button_down_event(int pad);
+void button_up_event(int pad, uint64_t hold_ms);
+void button_hold_event(int pad, uint64_t hold_ms);
+
+
+/* Install interrupt etc...
+ * woke_pad is the touch pad that woke us, or TOUCH_PAD_MAX */
+void button_init(int woke_pad);
+
+/* Change how often the pad is measured.
+ * Call from the button task (i.e. from an event), or when going to sleep. */
+void button_set_rate(enum touch_rate rate);
 
+/* Override the idle and deep sleep cycles (battery profile).
+ * Call before button_init(). */
+void button_set_cycles(uint16_t idle_cycle, uint16_t deep_cycle);
 
-/* Install interrupt etc... */
-void button_init(bool pushed_on);
+/* Slow down sampling before going into deep sleep */
+void button_prepare_sleep(void);
@@ -0,0 +1,130 @@
+#include "espnow_vars.h"
+#include "var_batch.h"
+#include "var_retry.h"
+#include "latency.h"
+#include "rf_cal.h"
+
+#include "esp_attr.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_now.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include <string.h>
+
+#define TAG "ESP-NOW"
+
+static const uint8_t peer_mac[ESP_NOW_ETH_ALEN] = ESPNOW_PEER_MAC;
+
+/* Send callback results */
+static QueueHandle_t send_status;
+
+static struct var_batch batch;
+
+/* Kept across deep sleep so the peer doesn't take a new wake's first
+ * frame for a resend (see VAR_EPOCH_NONE) */
+static RTC_DATA_ATTR uint16_t seq = 0;
+static RTC_DATA_ATTR uint8_t epoch = VAR_EPOCH_NONE;
+
+static void send_cb(const uint8_t *mac, esp_now_send_status_t status)
+{
+    /* Runs in the Wi-Fi task */
+    xQueueSend(send_status, &status, 0);
+}
+
+void espnow_vars_init(void)
+{
+    int64_t t_start = esp_timer_get_time();
+
+    send_status = xQueueCreate(4, sizeof(esp_now_send_status_t));
+    var_batch_init(&batch, &seq, &epoch, espnow_flush_vars);
+
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+
+    /* Just the radio - no scan, no association, no DHCP */
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+
+    int64_t t_radio = esp_timer_get_time();
+    ESP_ERROR_CHECK(esp_wifi_start());
+    rf_cal_radio_started(esp_timer_get_time() - t_radio);
+    ESP_ERROR_CHECK(esp_wifi_set_channel(ESPNOW_CHANNEL, WIFI_SECOND_CHAN_NONE));
+
+    ESP_ERROR_CHECK(esp_now_init());
+    ESP_ERROR_CHECK(esp_now_register_send_cb(send_cb));
+
+    esp_now_peer_info_t peer = {
+        .channel = ESPNOW_CHANNEL,
+        .ifidx = ESP_IF_WIFI_STA,
+        .encrypt = false,
+    };
+    memcpy(peer.peer_addr, peer_mac, ESP_NOW_ETH_ALEN);
+    ESP_ERROR_CHECK(esp_now_add_peer(&peer));
+
+    ESP_LOGI(TAG, "Ready on channel %d in %lld us", ESPNOW_CHANNEL, esp_timer_get_time() - t_start);
+}
+
+void espnow_set_int_var(char *name, int value)
+{
+    ESP_LOGI(TAG, "set %s=%d", name, value);
+    var_batch_set(&batch, name, value);
+}
+
+/* One attempt: send, then wait for the MAC layer's verdict */
+static bool send_once(const uint8_t *buf, int len, void *ctx)
+{
+    int *attempts = ctx;
+
+    /* Drop anything left over from a timed-out attempt */
+    xQueueReset(send_status);
+
+    esp_err_t err = esp_now_send(peer_mac, buf, len);
+    if(err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "esp_now_send failed: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    if((*attempts)++ == 0)
+    {
+        latency_radio();
+    }
+
+    esp_now_send_status_t status;
+    if(xQueueReceive(send_status, &status, pdMS_TO_TICKS(ESPNOW_SEND_TIMEOUT_MS)) != pdTRUE)
+    {
+        ESP_LOGI(TAG, "No send callback");
+        return false;
+    }
+
+    return status == ESP_NOW_SEND_SUCCESS;
+}
+
+bool espnow_flush_vars(void)
+{
+    struct var_packet packet;
+    uint16_t sent_seq;
+
+    if(!var_batch_take(&batch, 0, &packet, &sent_seq))
+    {
+        /* Nothing to send */
+        return true;
+    }
+
+    int64_t t_start = esp_timer_get_time();
+    int attempts = 0;
+
+    int sends = var_send_retry(&packet, ESPNOW_MAX_SENDS, send_once, &attempts);
+
+    ESP_LOGI(TAG, "seq %d: %d vars, %d bytes: %s after %d sends, %lld us",
+             sent_seq, packet.count, packet.len,
+             sends > 0 ? "delivered" : "NOT delivered",
+             sends > 0 ? sends : ESPNOW_MAX_SENDS,
+             esp_timer_get_time() - t_start);
+
+    return sends > 0;
+}
@@ -0,0 +1,24 @@
+#include <stdbool.h>
+
+/* The receiver we're paired with */
+#define ESPNOW_PEER_MAC { 0x24, 0x0A, 0xC4, 0x00, 0x00, 0x01 }
+
+/* Must match the receiver's channel - there's no association to find it */
+#define ESPNOW_CHANNEL 1
+
+/* Sends per packet before giving up */
+#define ESPNOW_MAX_SENDS 5
+
+/* How long to wait for the send callback */
+#define ESPNOW_SEND_TIMEOUT_MS 20
+
+/* Start Wi-Fi (no association) and ESP-NOW */
+void espnow_vars_init(void);
+
+/* Add a variable to the next packet.
+ * Nothing is sent until espnow_flush_vars() */
+void espnow_set_int_var(char *name, int value);
+
+/* Send everything added since the last flush in one frame,
+ * retrying until the peer's MAC acks it */
+bool espnow_flush_vars(void);
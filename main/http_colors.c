@@ -9,6 +9,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/timers.h"
@@ -23,11 +24,19 @@
 #include "nvs_flash.h"
 #include "esp_event.h"
 #include "esp_netif.h"
-#include "protocol_examples_common.h"
 #include "driver/touch_pad.h"
 #include "button.h"
+#include "app_core.h"
 #include "driver/gpio.h"
 #include "beacon.h"
+#include "wifi.h"
+#include "udp_vars.h"
+#include "battery.h"
+#include "latency.h"
+#include "espnow_vars.h"
+#include "rf_cal.h"
+#include "var_parser.h"
+#include "esp_timer.h"
 
 #include <math.h>
 
@@ -38,14 +47,37 @@
 #define HTTP_HOST "neep"
 #define HTTP_PORT 8080
 
-#define MAX_HTTP_OUTPUT_BUFFER 2048
+/* Without bluetooth: send variables to HTTP_HOST as UDP datagrams
+ * (udp_vars.h) instead of one HTTP request each */
+//#define USE_UDP
 
-/* Time before going back to sleep */
+/* Have the UDP receiver acknowledge each batch */
+#define UDP_WANT_ACK true
+
+/* Without bluetooth: send variables straight to a paired receiver with
+ * ESP-NOW (espnow_vars.h). No association, so no HTTP_HOST either. */
+//#define USE_ESPNOW
+
+/* Wi-Fi power saving between updates. Dropped to WIFI_PS_NONE
+ * while a finger is down, so the first frame doesn't wait for the
+ * modem to wake at the next DTIM beacon. */
+#if defined(USE_ESPNOW)
+#define WIFI_IDLE_PS WIFI_PS_MIN_MODEM
+#else
+#define WIFI_IDLE_PS WIFI_PS_MAX_MODEM
+#endif
+
+/* Time before going back to sleep (default; the battery profile sets it) */
 #define SLEEP_TIMEOUT_MS 10000
 
 /* A tap longer than this is considered a hold */
 #define TAP_MAX_MS 500
 
+/* Taps this close together are one burst, sent as a single update.
+ * A tap in progress (finger down, not yet a hold) holds the burst open too,
+ * so this only has to cover the gap between a release and the next touch. */
+#define TAP_COALESCE_MS 150
+
 /* Time required to sweep through all hues */
 #define HUE_SWEEP_MS 12000
 
@@ -71,11 +103,78 @@ static TimerHandle_t sleep_timer;
 
 /* Used to track whether we can sleept */
 static bool requesting = false;
+
+/* Input the request task hasn't acted on yet.
+ * Taps and holds add to these; the request task takes all of it in one go,
+ * so a burst of taps becomes one jump to the final state.
+ * 'requesting' only goes false with these empty, under the same lock.
+ * The lock also covers color_state and hue, which the request task
+ * changes while the button task reads them (radio_prewarm). */
+static portMUX_TYPE pending_mux = portMUX_INITIALIZER_UNLOCKED;
+static int pending_steps = 0;
+static int pending_hue = 0;
+
+/* For seeing when a burst of taps is over */
+static uint32_t last_tap_ms;
+static uint32_t touch_start_ms;
 static uint64_t last_wakey_wakey;
 
+static int sleep_timeout_ms = SLEEP_TIMEOUT_MS;
+
+/* Radio woken early by a finger down (radio_prewarm) */
+static bool prewarmed = false;
+static bool finger_down = false;
+
+/* What the server has told us its variables are. Updates that wouldn't
+ * change anything aren't sent. Only the HTTP transport hears back. */
+#define MAX_KNOWN_VARS 8
+
+struct known_var
+{
+    char name[VAR_NAME_MAX + 1];
+    int value;
+};
+
+static struct known_var known_vars[MAX_KNOWN_VARS];
+static int known_count = 0;
+
+static struct known_var *find_known(const char *name)
+{
+    for(int i = 0; i < known_count; i++)
+    {
+        if(!strcmp(known_vars[i].name, name))
+        {
+            return &known_vars[i];
+        }
+    }
+    return NULL;
+}
+
+static void remember_var(const char *name, int32_t value, void *ctx)
+{
+    struct known_var *k = find_known(name);
+    if(!k)
+    {
+        if(known_count == MAX_KNOWN_VARS)
+        {
+            return;
+        }
+        k = &known_vars[known_count++];
+        strcpy(k->name, name);
+    }
+    k->value = value;
+}
+
+/* One request's worth of response handling */
+struct http_response
+{
+    struct var_parser parser;
+    int body_len;
+};
+
 static esp_err_t _http_event_handler(esp_http_client_event_t *evt)
 {
-    static int output_len;       // Stores number of bytes read
+    struct http_response *resp = evt->user_data;
 
     switch(evt->event_id) {
         case HTTP_EVENT_ERROR:
@@ -95,76 +194,124 @@ static esp_err_t _http_event_handler(esp_http_client_event_t *evt)
             break;
         case HTTP_EVENT_ON_FINISH:
             ESP_LOGI(TAG, "HTTP_EVENT_ON_FINISH");
-            output_len = 0;
+            var_parser_finish(&resp->parser);
             break;
         case HTTP_EVENT_ON_DATA:
-            ESP_LOGI(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-            /*
-             *  Check for chunked encoding is added as the URL for chunked encoding used in this example returns binary data.
-             *  However, event handler can also be used in case chunked encoding is used.
-             */
-            // If user_data buffer is configured, copy the response into the buffer
-            if (evt->user_data) {
-                memcpy(evt->user_data + output_len, evt->data, evt->data_len);
-            }
-            output_len += evt->data_len;
-
+            /* Parsed where it lies in the client's receive buffer,
+             * so the body can be any length */
+            var_parser_feed(&resp->parser, evt->data, evt->data_len);
+            resp->body_len += evt->data_len;
             break;
     }
     return ESP_OK;
 }
 
-static void http_set_int_var(char *var, int value)
+/* GET /vars/<var>, with ?<query> if there is one.
+ * Variables in the response are remembered (see known_vars). */
+static esp_err_t http_vars_request(char *var, char *query)
 {
     char path_buff[100];
-    sprintf(path_buff, "/vars/%s", var);
+    snprintf(path_buff, sizeof(path_buff), "/vars/%s", var);
 
-    char query_buff[100];
-    sprintf(query_buff, "set=%d", value);
-
-    char local_response_buffer[MAX_HTTP_OUTPUT_BUFFER] = {0};
+    struct http_response resp = { .body_len = 0 };
+    var_parser_init(&resp.parser, remember_var, NULL);
 
     esp_http_client_config_t config = {
-        .host = HTTP_HOST,
+        .host = wifi_host(),
         .port = HTTP_PORT,
         .path = path_buff,
-        .query = query_buff,
+        .query = query,
         .event_handler = _http_event_handler,
-        .user_data = local_response_buffer,        // Pass address of local buffer to get response
+        .user_data = &resp,
     };
+    int64_t t_start = esp_timer_get_time();
+
     esp_http_client_handle_t client = esp_http_client_init(&config);
 
     // GET
     esp_err_t err = esp_http_client_perform(client);
     if (err == ESP_OK) {
-        ESP_LOGI(TAG, "HTTP GET Status = %d, content_length = %d",
+        ESP_LOGI(TAG, "HTTP GET Status = %d, %d bytes, %d vars, %lld us",
                 esp_http_client_get_status_code(client),
-                esp_http_client_get_content_length(client));
+                resp.body_len,
+                resp.parser.count,
+                esp_timer_get_time() - t_start);
     } else {
         ESP_LOGE(TAG, "HTTP GET request failed: %s", esp_err_to_name(err));
+
+        /* Maybe the host moved - look it up again next time */
+        wifi_invalidate_cache();
     }
-    ESP_LOG_BUFFER_CHAR(TAG, local_response_buffer, strlen(local_response_buffer));
 
     esp_http_client_cleanup(client);
 
+    return err;
+}
+
+static void http_set_int_var(char *var, int value)
+{
+    struct known_var *k = find_known(var);
+    if(k && k->value == value)
+    {
+        ESP_LOGI(TAG, "%s=%d already in effect", var, value);
+        return;
+    }
+
+    char query_buff[32];
+    snprintf(query_buff, sizeof(query_buff), "set=%d", value);
+
+    esp_err_t err = http_vars_request(var, query_buff);
+    latency_radio();
+
+    if(err == ESP_OK && !find_known(var))
+    {
+        /* The server didn't echo it back - assume it took */
+        remember_var(var, value, NULL);
+    }
+}
+
+/* Send a variable with whichever transport we're built for */
+static void set_int_var(char *name, int value)
+{
+#if defined(USE_BLUETOOTH)
+    beacon_set_int_var(name, value);
+#elif defined(USE_ESPNOW)
+    espnow_set_int_var(name, value);
+#elif defined(USE_UDP)
+    udp_set_int_var(name, value);
+#else
+    http_set_int_var(name, value);
+#endif
+}
+
+/* Push out anything the transport has batched up */
+static void flush_vars(void)
+{
+#if defined(USE_BLUETOOTH)
+    /* Beacon keeps its own queue */
+#elif defined(USE_ESPNOW)
+    espnow_flush_vars();
+#elif defined(USE_UDP)
+    udp_flush_vars(UDP_WANT_ACK);
+#endif
 }
 
-static int calc_bgr(float brightness)
+static int calc_bgr(int h, float brightness)
 {
     float c = brightness;
 
-    float wat = fmod(((float)hue / (float)60),2.0f) - 1.0f;
+    float wat = fmod(((float)h / (float)60),2.0f) - 1.0f;
     if(wat < 0) wat = -wat;
 
     float x = c * (1 - wat);
 
     float rf = 0,gf = 0,bf = 0;
-    if(hue < 60)       { rf = c; gf = x; bf = 0; }
-    else if(hue < 120) { rf = x; gf = c; bf = 0; }
-    else if(hue < 180) { rf = 0; gf = c; bf = x; }
-    else if(hue < 240) { rf = 0; gf = x; bf = c; }
-    else if(hue < 300) { rf = x; gf = 0; bf = c; }
-    else if(hue <= 359){ rf = c; gf = 0; bf = x; }
+    if(h < 60)       { rf = c; gf = x; bf = 0; }
+    else if(h < 120) { rf = x; gf = c; bf = 0; }
+    else if(h < 180) { rf = 0; gf = c; bf = x; }
+    else if(h < 240) { rf = 0; gf = x; bf = c; }
+    else if(h < 300) { rf = x; gf = 0; bf = c; }
+    else if(h <= 359){ rf = c; gf = 0; bf = x; }
 
 
     float m = brightness - c;
@@ -182,10 +329,19 @@ static int calc_bgr(float brightness)
         ((int)(rf * 0xFF));
 }
 
-static void run_request_task(void *pvParameters)
+/* What the server needs to be told for a state */
+struct color_vars
+{
+    int solid_mode;             /* -1 to leave as it is */
+    int col;
+};
+
+static struct color_vars vars_for_state(enum color_state_t state, int h)
 {
+    struct color_vars v = { .solid_mode = -1, .col = 0 };
+
     float brightness = 0;
-    switch(color_state)
+    switch(state)
     {
     case cs_SOLID_WHITE:
     case cs_NORMAL_HIGH:
@@ -202,57 +358,213 @@ static void run_request_task(void *pvParameters)
         break;
     }
 
-    switch(color_state)
+    switch(state)
     {
     case cs_OFF:
-#ifndef USE_BLUETOOTH
-        http_set_int_var("col", 0);
-#else
-        beacon_set_int_var("col", 0);
-#endif
+        v.col = 0;
         break;
     case cs_SOLID_WHITE:
-#ifndef USE_BLUETOOTH
-
-        http_set_int_var("solid_mode", 1);
-        http_set_int_var("col", 0xFFFFFF);
-#else
-        beacon_set_int_var("solid_mode", 1);
-        beacon_set_int_var("col", 0xFFFFFF);
-#endif
+        v.solid_mode = 1;
+        v.col = 0xFFFFFF;
         break;
 
     case cs_NORMAL_HIGH:
-
-#ifndef USE_BLUETOOTH
-        http_set_int_var("solid_mode", 0);
-        http_set_int_var("col", calc_bgr(brightness));
-#else
-        beacon_set_int_var("solid_mode", 0);
-        beacon_set_int_var("col", calc_bgr(brightness));
-#endif
+        v.solid_mode = 0;
+        v.col = calc_bgr(h, brightness);
         break;
 
     case cs_SOLID_HIGH:
     case cs_SOLID_LOW:
-
-#ifndef USE_BLUETOOTH
-        http_set_int_var("solid_mode", 1);
-        http_set_int_var("col", calc_bgr(brightness));
-#else
-        beacon_set_int_var("solid_mode", 1);
-        beacon_set_int_var("col", calc_bgr(brightness));
-#endif
+        v.solid_mode = 1;
+        v.col = calc_bgr(h, brightness);
         break;
     default:
         break;
     }
 
-    /* Don't let us sleep until this + the sleep delay */
-    last_wakey_wakey = pdTICKS_TO_MS(xTaskGetTickCount());
+    return v;
+}
+
+/* The state the server's variables say we're in - the reverse of vars_for_state().
+ * Sets hue too, if the colour has one. */
+static enum color_state_t state_for_vars(int solid_mode, int col)
+{
+    int r = col & 0xFF;
+    int g = (col >> 8) & 0xFF;
+    int b = (col >> 16) & 0xFF;
 
-    /* Completed request; now it's down to last_wakey_wakey */
-    requesting = false;
+    int max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+    int min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+    int d = max - min;
+
+    if(d > 0)
+    {
+        int h;
+        if(max == r)      h = 60 * (g - b) / d;
+        else if(max == g) h = 60 * (b - r) / d + 120;
+        else              h = 60 * (r - g) / d + 240;
+        hue = (h + 360) % 360;
+    }
+
+    if(col == 0)
+    {
+        return cs_OFF;
+    }
+    if(solid_mode == 1 && col == 0xFFFFFF)
+    {
+        return cs_SOLID_WHITE;
+    }
+    if(solid_mode == 0)
+    {
+        return cs_NORMAL_HIGH;
+    }
+
+    /* Between full and quarter brightness */
+    return max >= 0x80 ? cs_SOLID_HIGH : cs_SOLID_LOW;
+}
+
+/* After a power on (rather than a wake) we've forgotten what we set.
+ * Ask the server, so the next tap carries on from where it really is. */
+static void sync_from_server(void)
+{
+    if(http_vars_request("solid_mode", NULL) != ESP_OK ||
+       http_vars_request("col", NULL) != ESP_OK)
+    {
+        return;
+    }
+
+    struct known_var *mode = find_known("solid_mode");
+    struct known_var *col = find_known("col");
+    if(!col)
+    {
+        ESP_LOGI(TAG, "Server didn't say what col is");
+        return;
+    }
+
+    color_state = state_for_vars(mode ? mode->value : -1, col->value);
+    ESP_LOGI(TAG, "Synced with server: state %d, hue %d deg", color_state, hue);
+}
+
+/* Finger down: get the radio ready for the update a tap would send */
+static void radio_prewarm(void)
+{
+    if(prewarmed)
+    {
+        return;
+    }
+    prewarmed = true;
+
+#if defined(USE_BLUETOOTH)
+    /* col is the one that changes on every tap. Taps not yet sent count too */
+    portENTER_CRITICAL(&pending_mux);
+    enum color_state_t next_state = (color_state + pending_steps + 1) % cs_MAX;
+    int h = hue;
+    portEXIT_CRITICAL(&pending_mux);
+
+    struct color_vars next = vars_for_state(next_state, h);
+    beacon_prewarm("col", next.col);
+#else
+    /* Already associated; just keep the modem awake */
+    esp_wifi_set_ps(WIFI_PS_NONE);
+#endif
+}
+
+/* Done, or nothing is going to be sent after all */
+static void radio_cool(void)
+{
+    if(!prewarmed)
+    {
+        return;
+    }
+    prewarmed = false;
+
+#if defined(USE_BLUETOOTH)
+    beacon_prewarm_cancel();
+#else
+    esp_wifi_set_ps(WIFI_IDLE_PS);
+#endif
+}
+
+/* More taps may be on the way */
+static bool tap_burst_open(void)
+{
+    uint32_t now_ms = pdTICKS_TO_MS(xTaskGetTickCount());
+
+    portENTER_CRITICAL(&pending_mux);
+    bool open = pending_steps != 0 &&
+        ((finger_down && now_ms - touch_start_ms < TAP_MAX_MS) ||
+         now_ms - last_tap_ms < TAP_COALESCE_MS);
+    portEXIT_CRITICAL(&pending_mux);
+
+    return open;
+}
+
+static void run_request_task(void *pvParameters)
+{
+    ESP_LOGI(TAG, "Request on core %d", xPortGetCoreID());
+
+    for(;;)
+    {
+        /* Let a burst of taps finish, so it goes as one update */
+        while(tap_burst_open())
+        {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+
+        /* Everything that came in since the last update */
+        portENTER_CRITICAL(&pending_mux);
+        int steps = pending_steps;
+        int hue_delta = pending_hue;
+        pending_steps = 0;
+        pending_hue = 0;
+        if(steps == 0 && hue_delta == 0)
+        {
+            requesting = false;
+        }
+        color_state = (color_state + steps) % cs_MAX;
+        hue = (hue + hue_delta) % 360;
+        enum color_state_t state = color_state;
+        int h = hue;
+        portEXIT_CRITICAL(&pending_mux);
+
+        if(steps == 0 && hue_delta == 0)
+        {
+            break;
+        }
+
+        latency_send();
+
+        ESP_LOGI(TAG, "%d taps => state %d, %+d deg => hue %d deg",
+                 steps, state, hue_delta, h);
+
+        struct color_vars v = vars_for_state(state, h);
+        if(v.solid_mode != -1)
+        {
+            set_int_var("solid_mode", v.solid_mode);
+        }
+        set_int_var("col", v.col);
+
+        /* Piggyback the battery level on this update now and then */
+        if(battery_report_due())
+        {
+            set_int_var("battery_mv", battery_mv());
+            battery_reported();
+        }
+
+        flush_vars();
+
+        /* Don't let us sleep until this + the sleep delay */
+        last_wakey_wakey = pdTICKS_TO_MS(xTaskGetTickCount());
+    }
+
+    /* Holds send more while the finger stays down */
+    if(!finger_down)
+    {
+        radio_cool();
+    }
+
+    /* Completed request ('requesting' went false above);
+     * now it's down to last_wakey_wakey */
 
 /*     /\* For debug *\/ */
 /*     uint16_t touch_filter_value; */
@@ -268,54 +580,91 @@ static void run_request_task(void *pvParameters)
 }
 
 
-static void run_request(void)
+/* Queue some input, and start the request task if it isn't running.
+ * A running task picks it up when it's done with the current update. */
+static void run_request(int steps, int hue_delta)
 {
+    uint32_t now_ms = pdTICKS_TO_MS(xTaskGetTickCount());
+
+    portENTER_CRITICAL(&pending_mux);
+    pending_steps += steps;
+    pending_hue += hue_delta;
+    if(steps)
+    {
+        last_tap_ms = now_ms;
+    }
+    bool start = !requesting;
     requesting = true;
+    portEXIT_CRITICAL(&pending_mux);
+
+    latency_edge();
+
+    if(!start)
+    {
+        ESP_LOGI(TAG, "Queued behind the current request");
+        return;
+    }
 
     /* Do an HTTP! */
-    xTaskCreatePinnedToCore(&run_request_task, "http_test_task", 8192, NULL, 5, NULL, 0);
+    xTaskCreatePinnedToCore(&run_request_task, "http_test_task", 8192, NULL, 5, NULL, APP_CORE);
 }
 
-void button_down_event()
+/* All pads do the same thing for now */
+
+void button_down_event(int pad)
 {
     last_wakey_wakey = pdTICKS_TO_MS(xTaskGetTickCount());
-    ESP_LOGI(TAG, "button down");
+    ESP_LOGI(TAG, "button %d down", pad);
 
     gpio_set_level(2, 1);
+}
+
+void button_touch_event(int pad)
+{
+    portENTER_CRITICAL(&pending_mux);
+    touch_start_ms = pdTICKS_TO_MS(xTaskGetTickCount());
+    finger_down = true;
+    portEXIT_CRITICAL(&pending_mux);
+
+    /* Probably a tap coming: get the radio going now, while the touch
+     * is still being debounced, rather than on release */
+    radio_prewarm();
+}
+
+void button_blip_event(int pad)
+{
+    ESP_LOGI(TAG, "button %d blip", pad);
 
+    /* Nothing is coming after all */
+    finger_down = false;
+    radio_cool();
 }
 
-void button_up_event(uint64_t hold_ms)
+void button_up_event(int pad, uint64_t hold_ms)
 {
     last_wakey_wakey = pdTICKS_TO_MS(xTaskGetTickCount());
-    ESP_LOGI(TAG, "button up %" PRIu64 "ms", hold_ms);
+    ESP_LOGI(TAG, "button %d up %" PRIu64 "ms", pad, hold_ms);
 
     /* Turn the LED off */
     gpio_set_level(2, 0);
+    finger_down = false;
 
 
-    if(requesting)
-    {
-        /* One request at a time */
-        return;
-    }
-
     if(hold_ms <= TAP_MAX_MS)
     {
         /* Show tap = next state */
-        color_state = (color_state + 1) % cs_MAX;
-        ESP_LOGI(TAG, "Next state: %d", color_state);
-        run_request();
+        run_request(1, 0);
     }
     else
     {
-        /* This was a hold */
+        /* This was a hold - its updates have all gone */
+        radio_cool();
         return;
     }
 
 }
 
-void button_hold_event(uint64_t hold_ms)
+void button_hold_event(int pad, uint64_t hold_ms)
 {
     static uint64_t last_update_hold_ms = TAP_MAX_MS;
 
@@ -329,20 +678,18 @@ void button_hold_event(uint64_t hold_ms)
         /* Hold */
         uint64_t last_update_delta_ms = hold_ms - last_update_hold_ms;
 
-        if(!requesting)
-        {
-            /* Change the color */
-
-            /* Change it by this many degrees */
-            int hue_sweep_delta = 360 * last_update_delta_ms / HUE_SWEEP_MS;
-            ESP_LOGI(TAG, "button hold %" PRIu64 " ms => delta %d deg",
-                     last_update_delta_ms,
-                     hue_sweep_delta);
+        /* Change the color */
 
-            hue = (hue + hue_sweep_delta) % 360;
-            ESP_LOGI(TAG, "Next hue: %d deg", hue);
+        /* Change it by this many degrees */
+        int hue_sweep_delta = 360 * last_update_delta_ms / HUE_SWEEP_MS;
+        ESP_LOGI(TAG, "button hold %" PRIu64 " ms => delta %d deg",
+                 last_update_delta_ms,
+                 hue_sweep_delta);
 
-            run_request();
+        if(hue_sweep_delta != 0)
+        {
+            /* Added to whatever hasn't been sent yet */
+            run_request(0, hue_sweep_delta);
 
             last_update_hold_ms = hold_ms;
         }
@@ -354,26 +701,35 @@ void button_hold_event(uint64_t hold_ms)
 static void sleep_callback(TimerHandle_t xTimer)
 {
     /* Don't sleep when busy */
-    /* This is all in the main timer thread, so it's not going to change under our feet.
-     * We just need to make sure there is no state where buttons are idle
-     * and we need to do something, but 'requesting' is false.
-     * To ensure this, we only set 'requesting' from the timer thread.
+    /* Button events come from the button task and requests run on their own
+     * task, so things can change under our feet. What matters is that there
+     * is no state where buttons are idle and we need to do something, but
+     * 'requesting' is false. The button task sets 'requesting' when it queues
+     * input, and the request task only clears it once the queue is empty -
+     * both under pending_mux (see run_request_task).
      */
 
     if(requesting ||
-       last_wakey_wakey > pdTICKS_TO_MS(xTaskGetTickCount()) - SLEEP_TIMEOUT_MS)
+       last_wakey_wakey > pdTICKS_TO_MS(xTaskGetTickCount()) - sleep_timeout_ms)
     {
         /* sleep_callback is not one-shot, so we'll come here again */
         return;
     }
 
 
-    ESP_LOGI(TAG, "Sleeping");
+    ESP_LOGI(TAG, "Sleeping after %lld ms awake", esp_timer_get_time() / 1000);
+
+#ifdef CONFIG_PM_PROFILING
+    /* Time spent at each power level this wake - the energy side of
+     * the single/dual core trade-off */
+    esp_pm_dump_locks(stdout);
+#endif
 
     // Light sleep mode leaves the timer wakeup enabled
     // Make sure touchpad wakeup is the only one left on
     esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
     esp_sleep_enable_touchpad_wakeup();
+    button_prepare_sleep();
     rtc_gpio_isolate(GPIO_NUM_0);
     rtc_gpio_isolate(GPIO_NUM_2);
 
@@ -404,31 +760,45 @@ void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
+    /* Decide how hard to work before bringing anything up */
+    battery_init();
+    sleep_timeout_ms = battery_profile()->sleep_timeout_ms;
+
+    /* Reuse the stored RF calibration unless things have drifted */
+    rf_cal_check(battery_mv());
+
 
     /* Networking */
 
-#ifndef USE_BLUETOOTH
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    /* This helper function configures Wi-Fi or Ethernet, as selected in menuconfig.
-     * Read "Establishing Wi-Fi or Ethernet Connection" section in
-     * examples/protocols/README.md for more information about this function.
+#if defined(USE_BLUETOOTH)
+    beacon_init();
+#elif defined(USE_ESPNOW)
+    espnow_vars_init();
+#else
+    /* Reconnects using what we remembered from the last wake if it can;
+     * see wifi.h. The AP is configured in menuconfig as for example_connect().
      */
-    ESP_ERROR_CHECK(example_connect());
-    esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+    ESP_ERROR_CHECK(wifi_connect(HTTP_HOST));
+    esp_wifi_set_ps(WIFI_IDLE_PS);
     ESP_LOGI(TAG, "Connected to AP, begin http example");
 
+#ifdef USE_UDP
+    udp_vars_init();
 #else
-    beacon_init();
+    if(esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED)
+    {
+        sync_from_server();
+    }
 #endif
 
+#endif
 
-    touch_pad_t tp = esp_sleep_get_touchpad_wakeup_status();
 
-    bool woke_by_touch_pad = tp == TOUCH_PAD_ID;
+    /* TOUCH_PAD_MAX if it wasn't a touch that woke us */
+    touch_pad_t tp = esp_sleep_get_touchpad_wakeup_status();
 
-    /* Init GPIO and touch pad */
-    button_init(woke_by_touch_pad);
+    /* Init GPIO and touch pads */
+    button_init(tp);
 
     /* Power saving stuff */
 
@@ -442,7 +812,7 @@ void app_main(void)
     /* Sleepy stuff */
 
     sleep_timer = xTimerCreate("Sleep Timer",
-                              pdMS_TO_TICKS(SLEEP_TIMEOUT_MS),
+                              pdMS_TO_TICKS(sleep_timeout_ms),
                               1, // Autoreload
                               0, // Timer ID = 0
                               sleep_callback // Callback fn
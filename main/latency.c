@@ -0,0 +1,67 @@
+#include "latency.h"
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <sys/time.h>
+
+#define TAG "Latency"
+
+/* Unique across wakes */
+static RTC_DATA_ATTR uint16_t next_gesture_id;
+
+static struct latency_trace trace;
+
+/* Wall clock minus esp_timer, so ISR stamps can be converted later */
+static int64_t clock_offset_us;
+static bool have_offset = false;
+
+static int64_t to_wall_clock(int64_t timer_us)
+{
+    if(!have_offset)
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        clock_offset_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - esp_timer_get_time();
+        have_offset = true;
+    }
+
+    return timer_us + clock_offset_us;
+}
+
+void latency_touch(int64_t isr_us, bool woke)
+{
+    trace.gesture_id = next_gesture_id++;
+    trace.t_touch = to_wall_clock(isr_us);
+    trace.t_wake = woke ? to_wall_clock(0) : trace.t_touch;
+    trace.t_down = trace.t_edge = trace.t_send = trace.t_radio = 0;
+}
+
+void latency_down(void)
+{
+    trace.t_down = to_wall_clock(esp_timer_get_time());
+}
+
+void latency_edge(void)
+{
+    trace.t_edge = to_wall_clock(esp_timer_get_time());
+}
+
+void latency_send(void)
+{
+    trace.t_send = to_wall_clock(esp_timer_get_time());
+}
+
+void latency_radio(void)
+{
+    trace.t_radio = to_wall_clock(esp_timer_get_time());
+
+    ESP_LOGI(TAG, "LAT gid=%u wake=%lld touch=%lld down=%lld edge=%lld send=%lld radio=%lld",
+             trace.gesture_id, trace.t_wake, trace.t_touch, trace.t_down,
+             trace.t_edge, trace.t_send, trace.t_radio);
+}
+
+const struct latency_trace *latency_current(void)
+{
+    return &trace;
+}
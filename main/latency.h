@@ -0,0 +1,39 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Stamp outgoing frames with the gesture id and touch time
+ * (iBeacon major/minor, or a trailer on UDP packets).
+ * Off by default, as it changes what receivers see. */
+//#define LATENCY_IN_FRAMES
+
+/* Where one gesture has got to. Times are us on the RTC-backed
+ * wall clock, so they carry on across deep sleep. */
+struct latency_trace
+{
+    uint16_t gesture_id;
+    /* Boot, if this touch woke us; otherwise the same as t_touch */
+    int64_t t_wake;
+    /* The ISR (or button_init, after a wake) saw the touch */
+    int64_t t_touch;
+    /* Debounce confirmed the press */
+    int64_t t_down;
+    /* Debounce confirmed the edge that caused the update - the
+     * release for a tap, so t_down to here is the finger on the pad */
+    int64_t t_edge;
+    /* The request task started sending */
+    int64_t t_send;
+    /* The transport handed the frame to the radio */
+    int64_t t_radio;
+};
+
+/* A new touch. 'isr_us' is esp_timer time. */
+void latency_touch(int64_t isr_us, bool woke);
+
+void latency_down(void);
+void latency_edge(void);
+void latency_send(void);
+
+/* Logs the whole trace as a "LAT ..." line for tools/latency_report.c */
+void latency_radio(void);
+
+const struct latency_trace *latency_current(void);
@@ -0,0 +1,86 @@
+#include "rf_cal.h"
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_phy_init.h"
+#include "esp_system.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define TAG "RF cal"
+
+/* Conditions when the stored calibration was made */
+static RTC_DATA_ATTR bool have_reference = false;
+static RTC_DATA_ATTR int ref_mv;
+static RTC_DATA_ATTR int wakes_since_cal;
+
+/* Average radio bring-up times, to show what reuse saves */
+static RTC_DATA_ATTR int64_t full_us_total;
+static RTC_DATA_ATTR int full_count;
+static RTC_DATA_ATTR int64_t reuse_us_total;
+static RTC_DATA_ATTR int reuse_count;
+
+/* Is this wake doing a full calibration? */
+static bool full_cal = false;
+
+void rf_cal_check(int battery_mv)
+{
+    const char *reason = NULL;
+
+    if(esp_reset_reason() != ESP_RST_DEEPSLEEP || !have_reference)
+    {
+        /* IDF calibrates (at least partially) on any other kind of boot */
+        reason = "boot";
+    }
+    else if(wakes_since_cal >= RF_CAL_MAX_WAKES)
+    {
+        reason = "age";
+    }
+    else if(battery_mv && ref_mv && abs(battery_mv - ref_mv) > RF_CAL_MV_DRIFT)
+    {
+        reason = "voltage";
+    }
+
+    if(reason == NULL)
+    {
+        /* Stored data is fine - the PHY loads it instead of calibrating */
+        wakes_since_cal++;
+        full_cal = false;
+        return;
+    }
+
+    ESP_LOGI(TAG, "Recalibrating (%s): %d mV (was %d), %d wakes",
+             reason, battery_mv, ref_mv, wakes_since_cal);
+
+    if(have_reference && esp_reset_reason() == ESP_RST_DEEPSLEEP)
+    {
+        /* With no stored data the PHY falls back to a full calibration,
+         * and stores the result for next time */
+        esp_phy_erase_cal_data_in_nvs();
+    }
+
+    have_reference = true;
+    ref_mv = battery_mv;
+    wakes_since_cal = 0;
+    full_cal = true;
+}
+
+void rf_cal_radio_started(int64_t startup_us)
+{
+    if(full_cal)
+    {
+        full_us_total += startup_us;
+        full_count++;
+    }
+    else
+    {
+        reuse_us_total += startup_us;
+        reuse_count++;
+    }
+
+    ESP_LOGI(TAG, "Radio up in %lld us (%s); average calibrating %lld us, reusing %lld us",
+             startup_us,
+             full_cal ? "calibrated" : "reused calibration",
+             full_count ? full_us_total / full_count : 0,
+             reuse_count ? reuse_us_total / reuse_count : 0);
+}
@@ -0,0 +1,19 @@
+#include <stdint.h>
+
+/* RF calibration data is kept in NVS (CONFIG_ESP32_PHY_CALIBRATION_AND_DATA_STORAGE)
+ * and reused on wake. These decide when it's too old to trust. */
+
+/* Force a full calibration after this many wakes.
+ * There's no temperature trigger: the ESP32's internal temperature
+ * sensor isn't usable on current revisions (it reads a constant 128),
+ * so with BATTERY_SENSE off this is the only thing that recalibrates. */
+#define RF_CAL_MAX_WAKES 500
+
+/* ... or if the supply has moved this much (when it's known - see battery_mv()) */
+#define RF_CAL_MV_DRIFT 200
+
+/* Call before the first radio (BT or Wi-Fi) starts this wake */
+void rf_cal_check(int battery_mv);
+
+/* Report how long the radio took to come up, so the saving is visible */
+void rf_cal_radio_started(int64_t startup_us);
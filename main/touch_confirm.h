@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Deciding whether a touch wake was a real touch.
+ * Used from the deep sleep wake stub, so it must inline into RTC code:
+ * no library calls, no globals. Plain C, so it can also be built on a host. */
+
+/* Samples taken by the wake stub */
+#define TOUCH_CONFIRM_SAMPLES 3
+
+/* How many of them must be touched (the last one always must be) */
+#define TOUCH_CONFIRM_NEEDED 2
+
+#define TOUCH_CONFIRM_INLINE static inline __attribute__((always_inline))
+
+/* Where the stub finds a pad's reading. SENS_SAR_TOUCH_OUT1_REG onwards
+ * hold two readings each, the odd slot in the low half - but pads 8 and 9
+ * are wired up the other way round (IDF's TOUCH_BITS_SWAP), so pad 9 is
+ * slot 8. */
+TOUCH_CONFIRM_INLINE int touch_pad_slot(int pad)
+{
+    return pad == 8 ? 9 : pad == 9 ? 8 : pad;
+}
+
+/* Which register, counting from SENS_SAR_TOUCH_OUT1_REG */
+TOUCH_CONFIRM_INLINE int touch_pad_reg_index(int pad)
+{
+    return touch_pad_slot(pad) / 2;
+}
+
+TOUCH_CONFIRM_INLINE bool touch_pad_in_low_half(int pad)
+{
+    return touch_pad_slot(pad) & 1;
+}
+
+/* 'samples' are raw pad readings, oldest first; lower = touched.
+ * A zero reading means the pad wasn't measured - we can't tell,
+ * so let the app boot and decide. */
+TOUCH_CONFIRM_INLINE bool touch_confirm(const uint16_t *samples, int n,
+                                        uint16_t threshold, int needed)
+{
+    int touched = 0;
+
+    for(int i = 0; i < n; i++)
+    {
+        if(samples[i] == 0)
+        {
+            return true;
+        }
+
+        if(samples[i] < threshold)
+        {
+            touched++;
+        }
+    }
+
+    /* Must still be down now, and have been for most of the window */
+    return n > 0 && samples[n - 1] < threshold && touched >= needed;
+}
@@ -0,0 +1,155 @@
+#include "udp_vars.h"
+#include "var_batch.h"
+#include "wifi.h"
+#include "latency.h"
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#include <string.h>
+
+#define TAG "UDP"
+
+static int sock = -1;
+static struct sockaddr_in dest;
+
+static struct var_batch batch;
+
+/* Carried across deep sleep, so each wake doesn't start again at seq 0
+ * and look like a resend to the receiver. A power on picks a new epoch. */
+static RTC_DATA_ATTR uint16_t seq = 0;
+static RTC_DATA_ATTR uint8_t epoch = VAR_EPOCH_NONE;
+
+/* When a variable doesn't fit the packet */
+static bool flush_full(void)
+{
+    return udp_flush_vars(false);
+}
+
+/* wifi_host() is a dotted quad if wifi_connect() resolved the host,
+ * otherwise the name itself - so this can still mean a DNS lookup */
+static bool resolve_dest(const char *host)
+{
+    const struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_DGRAM,
+    };
+    struct addrinfo *res;
+
+    int err = getaddrinfo(host, NULL, &hints, &res);
+    if(err != 0 || res == NULL)
+    {
+        ESP_LOGE(TAG, "Couldn't resolve %s: %d", host, err);
+        return false;
+    }
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(UDP_VARS_PORT);
+    dest.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return true;
+}
+
+void udp_vars_init(void)
+{
+    var_batch_init(&batch, &seq, &epoch, flush_full);
+
+    /* Nowhere to send to - leave sock at -1 so flushes fail */
+    if(!resolve_dest(wifi_host()))
+    {
+        return;
+    }
+
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if(sock < 0)
+    {
+        ESP_LOGE(TAG, "Couldn't create socket: errno %d", errno);
+        return;
+    }
+
+    struct timeval timeout = {
+        .tv_sec = 0,
+        .tv_usec = UDP_ACK_TIMEOUT_MS * 1000,
+    };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+void udp_set_int_var(char *name, int value)
+{
+    ESP_LOGI(TAG, "set %s=%d", name, value);
+    var_batch_set(&batch, name, value);
+}
+
+/* Wait for the ack for 'want_seq'. Stale acks are skipped */
+static bool wait_for_ack(uint16_t want_seq)
+{
+    uint8_t buf[VAR_PACKET_HEADER_LEN];
+
+    for(;;)
+    {
+        int len = recv(sock, buf, sizeof(buf), 0);
+        if(len < 0)
+        {
+            /* Timed out */
+            return false;
+        }
+
+        struct var_packet_header hdr;
+        if(var_packet_parse(buf, len, &hdr, NULL, NULL) &&
+           (hdr.flags & VAR_FLAG_ACK) &&
+           hdr.seq == want_seq)
+        {
+            return true;
+        }
+    }
+}
+
+bool udp_flush_vars(bool want_ack)
+{
+    if(sock < 0)
+    {
+        return false;
+    }
+
+    struct var_packet packet;
+    uint16_t sent_seq;
+
+    if(!var_batch_take(&batch, want_ack ? VAR_FLAG_ACK_REQ : 0, &packet, &sent_seq))
+    {
+        /* Nothing to send */
+        return true;
+    }
+
+    int64_t t_start = esp_timer_get_time();
+
+    int sends = 0;
+    bool acked = false;
+
+    while(sends < UDP_MAX_SENDS && !acked)
+    {
+        sends++;
+        if(sendto(sock, packet.buf, packet.len, 0,
+                  (struct sockaddr *)&dest, sizeof(dest)) < 0)
+        {
+            ESP_LOGE(TAG, "sendto failed: errno %d", errno);
+            continue;
+        }
+
+        if(sends == 1)
+        {
+            latency_radio();
+        }
+
+        acked = !want_ack || wait_for_ack(sent_seq);
+    }
+
+    ESP_LOGI(TAG, "seq %d: %d vars, %d bytes, %d sends, %s in %lld us",
+             sent_seq, packet.count, packet.len, sends,
+             acked ? (want_ack ? "acked" : "sent") : "NOT acked",
+             esp_timer_get_time() - t_start);
+
+    return acked;
+}
@@ -0,0 +1,22 @@
+#include <stdbool.h>
+
+/* Port the receiver listens on (see tools/udp_receiver.c) */
+#define UDP_VARS_PORT 8266
+
+/* How long to wait for an ack before sending again */
+#define UDP_ACK_TIMEOUT_MS 50
+
+/* Sends before we give up on an ack */
+#define UDP_MAX_SENDS 4
+
+/* Set up the socket. Call after wifi_connect().
+ * If the host can't be resolved, nothing will be sent. */
+void udp_vars_init(void);
+
+/* Add a variable to the next packet.
+ * Nothing is sent until udp_flush_vars() */
+void udp_set_int_var(char *name, int value);
+
+/* Send everything added since the last flush in one datagram.
+ * If want_ack, resend until the receiver acks or we run out of tries. */
+bool udp_flush_vars(bool want_ack);
@@ -0,0 +1,77 @@
+#include "var_batch.h"
+#include "latency.h"
+
+#include "esp_system.h"
+#include <assert.h>
+
+static void start_pending(struct var_batch *b)
+{
+    var_packet_init(&b->pending, *b->seq, 0);
+    var_packet_set_epoch(&b->pending, *b->epoch);
+}
+
+void var_batch_init(struct var_batch *b, uint16_t *seq, uint8_t *epoch,
+                    var_flush_fn flush)
+{
+    b->mutex = xSemaphoreCreateMutex();
+    b->seq = seq;
+    b->epoch = epoch;
+    b->flush = flush;
+
+    if(*epoch == VAR_EPOCH_NONE)
+    {
+        /* Power on */
+        *epoch = 1 + esp_random() % 255;
+    }
+
+    start_pending(b);
+}
+
+void var_batch_set(struct var_batch *b, const char *name, int32_t value)
+{
+    assert(xSemaphoreTake(b->mutex, portMAX_DELAY) == pdTRUE);
+
+    if(!var_packet_add(&b->pending, name, value))
+    {
+        /* Full - send what we have and start another */
+        xSemaphoreGive(b->mutex);
+        b->flush();
+        assert(xSemaphoreTake(b->mutex, portMAX_DELAY) == pdTRUE);
+        var_packet_add(&b->pending, name, value);
+    }
+
+    xSemaphoreGive(b->mutex);
+}
+
+bool var_batch_take(struct var_batch *b, uint8_t flags,
+                    struct var_packet *out, uint16_t *out_seq)
+{
+    assert(xSemaphoreTake(b->mutex, portMAX_DELAY) == pdTRUE);
+
+    if(b->pending.count == 0)
+    {
+        xSemaphoreGive(b->mutex);
+        return false;
+    }
+
+    *out = b->pending;
+    out->buf[3] |= flags;
+    *out_seq = (*b->seq)++;
+    start_pending(b);
+
+    xSemaphoreGive(b->mutex);
+
+#ifdef LATENCY_IN_FRAMES
+    const struct latency_trace *lat = latency_current();
+    struct var_trace trace = {
+        .gesture_id = lat->gesture_id,
+        .touch_ms = lat->t_touch / 1000,
+        .edge_us = lat->t_edge - lat->t_touch,
+        .send_us = lat->t_send - lat->t_touch,
+        .down_us = lat->t_down - lat->t_touch,
+    };
+    var_packet_add_trace(out, &trace);
+#endif
+
+    return true;
+}
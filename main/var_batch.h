@@ -0,0 +1,42 @@
+#pragma once
+
+#include "var_packet.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Collects variables into a packet until the transport flushes it.
+ * Shared by the UDP and ESP-NOW transports, which only differ in how
+ * a packet gets sent. */
+
+/* Sends everything batched so far */
+typedef bool (*var_flush_fn)(void);
+
+struct var_batch
+{
+    /* Guards pending, and seq */
+    SemaphoreHandle_t mutex;
+    struct var_packet pending;
+
+    /* The transport's, in RTC memory (see VAR_EPOCH_NONE) */
+    uint16_t *seq;
+    uint8_t *epoch;
+
+    /* Called when a variable doesn't fit */
+    var_flush_fn flush;
+};
+
+/* Picks a new epoch if this is a power on */
+void var_batch_init(struct var_batch *b, uint16_t *seq, uint8_t *epoch,
+                    var_flush_fn flush);
+
+/* Add a variable, flushing first if the packet is full */
+void var_batch_set(struct var_batch *b, const char *name, int32_t value);
+
+/* Take the batched packet for sending, with 'flags' set and, with
+ * LATENCY_IN_FRAMES, the latency trailer. A new packet is started.
+ * Returns false if there was nothing to send. */
+bool var_batch_take(struct var_batch *b, uint8_t flags,
+                    struct var_packet *out, uint16_t *out_seq);
@@ -0,0 +1,157 @@
+#include "var_packet.h"
+
+#include <string.h>
+
+void var_packet_init(struct var_packet *p, uint16_t seq, uint8_t flags)
+{
+    p->buf[0] = VAR_PACKET_MAGIC0;
+    p->buf[1] = VAR_PACKET_MAGIC1;
+    p->buf[2] = VAR_PACKET_VERSION;
+    p->buf[3] = flags;
+    p->buf[4] = seq >> 8;
+    p->buf[5] = seq & 0xFF;
+    p->buf[6] = 0;
+    p->buf[7] = 0;
+    p->len = VAR_PACKET_HEADER_LEN;
+    p->count = 0;
+}
+
+void var_packet_set_epoch(struct var_packet *p, uint8_t epoch)
+{
+    p->buf[7] = epoch;
+}
+
+static uint8_t *put_u32(uint8_t *out, uint32_t v)
+{
+    *out++ = v >> 24;
+    *out++ = v >> 16;
+    *out++ = v >> 8;
+    *out++ = v;
+    return out;
+}
+
+static uint32_t get_u32(const uint8_t *in)
+{
+    return ((uint32_t)in[0] << 24) |
+        ((uint32_t)in[1] << 16) |
+        ((uint32_t)in[2] << 8) |
+        in[3];
+}
+
+bool var_packet_add(struct var_packet *p, const char *name, int32_t value)
+{
+    int name_len = strlen(name);
+
+    if((p->buf[3] & VAR_FLAG_TRACE) ||
+       name_len > VAR_NAME_MAX ||
+       p->count == 0xFF ||
+       p->len + 1 + name_len + 4 > VAR_PACKET_MAX)
+    {
+        return false;
+    }
+
+    uint8_t *out = p->buf + p->len;
+    *out++ = name_len;
+    memcpy(out, name, name_len);
+    out += name_len;
+
+    out = put_u32(out, value);
+
+    p->len = out - p->buf;
+    p->buf[6] = ++p->count;
+    return true;
+}
+
+bool var_packet_add_trace(struct var_packet *p, const struct var_trace *trace)
+{
+    if((p->buf[3] & VAR_FLAG_TRACE) ||
+       p->len + VAR_TRACE_LEN > VAR_PACKET_MAX)
+    {
+        return false;
+    }
+
+    uint8_t *out = p->buf + p->len;
+    *out++ = trace->gesture_id >> 8;
+    *out++ = trace->gesture_id & 0xFF;
+    out = put_u32(out, trace->touch_ms);
+    out = put_u32(out, trace->edge_us);
+    out = put_u32(out, trace->send_us);
+    out = put_u32(out, trace->down_us);
+
+    p->len = out - p->buf;
+    p->buf[3] |= VAR_FLAG_TRACE;
+    return true;
+}
+
+bool var_packet_parse(const uint8_t *buf, int len,
+                      struct var_packet_header *hdr,
+                      var_packet_cb cb, void *ctx)
+{
+    if(len < VAR_PACKET_HEADER_LEN ||
+       buf[0] != VAR_PACKET_MAGIC0 ||
+       buf[1] != VAR_PACKET_MAGIC1 ||
+       buf[2] != VAR_PACKET_VERSION)
+    {
+        return false;
+    }
+
+    hdr->version = buf[2];
+    hdr->flags = buf[3];
+    hdr->seq = (buf[4] << 8) | buf[5];
+    hdr->count = buf[6];
+    hdr->epoch = buf[7];
+
+    /* Check the whole thing before reporting anything */
+    int pos = VAR_PACKET_HEADER_LEN;
+    for(int i = 0; i < hdr->count; i++)
+    {
+        if(pos >= len)
+        {
+            return false;
+        }
+
+        int name_len = buf[pos];
+        if(name_len > VAR_NAME_MAX || pos + 1 + name_len + 4 > len)
+        {
+            return false;
+        }
+        pos += 1 + name_len + 4;
+    }
+
+    if(hdr->flags & VAR_FLAG_TRACE)
+    {
+        if(pos + VAR_TRACE_LEN > len)
+        {
+            return false;
+        }
+
+        const uint8_t *in = buf + pos;
+        hdr->trace.gesture_id = (in[0] << 8) | in[1];
+        hdr->trace.touch_ms = get_u32(in + 2);
+        hdr->trace.edge_us = get_u32(in + 6);
+        hdr->trace.send_us = get_u32(in + 10);
+        hdr->trace.down_us = get_u32(in + 14);
+    }
+
+    if(cb == NULL)
+    {
+        return true;
+    }
+
+    pos = VAR_PACKET_HEADER_LEN;
+    for(int i = 0; i < hdr->count; i++)
+    {
+        char name[VAR_NAME_MAX + 1];
+        int name_len = buf[pos++];
+        memcpy(name, buf + pos, name_len);
+        name[name_len] = '\0';
+        pos += name_len;
+
+        uint32_t v = get_u32(buf + pos);
+        pos += 4;
+
+        cb(name, (int32_t)v, ctx);
+    }
+
+    return true;
+}
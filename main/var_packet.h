@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Compact binary framing for variable updates.
+ * Plain C with no IDF dependencies, so the host tools can share it.
+ *
+ * Header (8 bytes):
+ *   'P' 'J' version flags seq_hi seq_lo count epoch
+ * Then 'count' entries of:
+ *   name_len name[name_len] value (int32, big endian)
+ * Then, if VAR_FLAG_TRACE is set, a latency trailer (big endian):
+ *   gesture_id (16) touch_ms (32) edge_us (32) send_us (32) down_us (32)
+ * (down_us came last, so older receivers still read the rest)
+ */
+
+#define VAR_PACKET_MAGIC0 'P'
+#define VAR_PACKET_MAGIC1 'J'
+#define VAR_PACKET_VERSION 1
+
+#define VAR_PACKET_HEADER_LEN 8
+
+/* Fits in one ESP-NOW frame (250 bytes) as well as a UDP datagram */
+#define VAR_PACKET_MAX 250
+
+#define VAR_NAME_MAX 19
+
+/* Sender wants this packet acknowledged */
+#define VAR_FLAG_ACK_REQ 0x01
+/* This packet is an acknowledgement of 'seq' */
+#define VAR_FLAG_ACK 0x02
+/* There's a latency trailer after the variables */
+#define VAR_FLAG_TRACE 0x04
+
+#define VAR_TRACE_LEN 18
+
+/* A sender's seq only means anything within its epoch: seq carries on
+ * across deep sleep, but starts again from 0 after a power on, when the
+ * sender picks a new epoch. Receivers dedup on (sender, epoch, seq).
+ * 0 means the sender doesn't do epochs. */
+#define VAR_EPOCH_NONE 0
+
+struct var_packet
+{
+    uint8_t buf[VAR_PACKET_MAX];
+    int len;
+    int count;
+};
+
+/* Where a gesture had got to when the packet was sent */
+struct var_trace
+{
+    uint16_t gesture_id;
+    /* Device wall clock, ms (wraps) */
+    uint32_t touch_ms;
+    /* Relative to the touch */
+    uint32_t edge_us;
+    uint32_t send_us;
+    uint32_t down_us;
+};
+
+struct var_packet_header
+{
+    uint8_t version;
+    uint8_t flags;
+    uint16_t seq;
+    uint8_t count;
+    uint8_t epoch;
+    /* Valid if flags has VAR_FLAG_TRACE */
+    struct var_trace trace;
+};
+
+/* Called once per variable while parsing */
+typedef void (*var_packet_cb)(const char *name, int32_t value, void *ctx);
+
+/* Start a new packet */
+void var_packet_init(struct var_packet *p, uint16_t seq, uint8_t flags);
+
+/* Mark the packet with the sender's epoch (see VAR_EPOCH_NONE) */
+void var_packet_set_epoch(struct var_packet *p, uint8_t epoch);
+
+/* Append a variable. Returns false if it doesn't fit. */
+bool var_packet_add(struct var_packet *p, const char *name, int32_t value);
+
+/* Append the latency trailer. Nothing can be added after this. */
+bool var_packet_add_trace(struct var_packet *p, const struct var_trace *trace);
+
+/* Validate a received packet and call 'cb' for each variable.
+ * Returns false if it's malformed - 'cb' won't have been called. */
+bool var_packet_parse(const uint8_t *buf, int len,
+                      struct var_packet_header *hdr,
+                      var_packet_cb cb, void *ctx);
@@ -0,0 +1,168 @@
+#include "var_parser.h"
+
+#include <string.h>
+
+void var_parser_init(struct var_parser *p, var_packet_cb cb, void *ctx)
+{
+    memset(p, 0, sizeof(*p));
+    p->state = VP_SEEK;
+    p->cb = cb;
+    p->ctx = ctx;
+}
+
+static bool is_name_char(char c)
+{
+    return (c >= 'a' && c <= 'z') ||
+           (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') ||
+           c == '_';
+}
+
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static void start_name(struct var_parser *p, char c)
+{
+    p->state = VP_NAME;
+    p->name[0] = c;
+    p->name_len = 1;
+    p->name_too_long = false;
+}
+
+static void emit(struct var_parser *p)
+{
+    if(p->have_digits && !p->name_too_long && !p->value_too_big)
+    {
+        p->name[p->name_len] = '\0';
+        p->count++;
+        if(p->cb)
+        {
+            p->cb(p->name, (int32_t)(p->negative ? -p->value : p->value), p->ctx);
+        }
+    }
+    p->state = VP_SEEK;
+}
+
+void var_parser_feed(struct var_parser *p, const char *data, int len)
+{
+    for(int i = 0; i < len; i++)
+    {
+        char c = data[i];
+
+        switch(p->state)
+        {
+        case VP_SEEK:
+            if(is_name_char(c))
+            {
+                start_name(p, c);
+            }
+            break;
+
+        case VP_NAME:
+            if(is_name_char(c))
+            {
+                if(p->name_len < VAR_NAME_MAX)
+                {
+                    p->name[p->name_len++] = c;
+                }
+                else
+                {
+                    p->name_too_long = true;
+                }
+            }
+            else if(c == '=' || c == ':')
+            {
+                p->state = VP_VALUE_START;
+            }
+            else if(c == '"' || c == ' ' || c == '\t')
+            {
+                p->state = VP_AFTER_NAME;
+            }
+            else
+            {
+                p->state = VP_SEEK;
+            }
+            break;
+
+        case VP_AFTER_NAME:
+            /* Closing quote of a JSON key, and whitespace, before the separator */
+            if(c == '=' || c == ':')
+            {
+                p->state = VP_VALUE_START;
+            }
+            else if(is_name_char(c))
+            {
+                /* Wasn't a name after all - maybe this is */
+                start_name(p, c);
+            }
+            else if(c != '"' && c != ' ' && c != '\t')
+            {
+                p->state = VP_SEEK;
+            }
+            break;
+
+        case VP_VALUE_START:
+            p->value = 0;
+            p->negative = false;
+            p->have_digits = false;
+            p->value_too_big = false;
+
+            if(c == '-')
+            {
+                p->negative = true;
+                p->state = VP_VALUE;
+            }
+            else if(is_digit(c))
+            {
+                p->value = c - '0';
+                p->have_digits = true;
+                p->state = VP_VALUE;
+            }
+            else if(is_name_char(c))
+            {
+                start_name(p, c);
+            }
+            else if(c != ' ' && c != '\t')
+            {
+                /* A string or an object - not ours. Its contents get
+                 * looked at as if they were names, which is harmless */
+                p->state = VP_SEEK;
+            }
+            break;
+
+        case VP_VALUE:
+            if(is_digit(c))
+            {
+                p->have_digits = true;
+                if(!p->value_too_big)
+                {
+                    p->value = p->value * 10 + (c - '0');
+
+                    /* It won't be reported, but read to the end of it */
+                    p->value_too_big = p->value > (int64_t)INT32_MAX + p->negative;
+                }
+            }
+            else
+            {
+                emit(p);
+                if(is_name_char(c))
+                {
+                    /* "a=1b=2" isn't valid, but don't run them together */
+                    start_name(p, c);
+                }
+            }
+            break;
+        }
+    }
+}
+
+void var_parser_finish(struct var_parser *p)
+{
+    if(p->state == VP_VALUE)
+    {
+        emit(p);
+    }
+    p->state = VP_SEEK;
+}
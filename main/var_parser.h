@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "var_packet.h"
+
+/* Streaming parser for variable values in a server's response body.
+ * Fed the body a chunk at a time as it arrives, straight from the
+ * receive buffer - nothing is copied except the name being read.
+ * Plain C with no IDF dependencies, so the host tools can share it.
+ *
+ * Picks out
+ *   name=123      (form / plain text, one per line or '&' separated)
+ *   "name": -45   (JSON)
+ * and ignores anything else. Names longer than VAR_NAME_MAX and
+ * numbers that don't fit an int32 are skipped, not truncated.
+ */
+
+enum var_parser_state
+{
+    VP_SEEK,
+    VP_NAME,
+    VP_AFTER_NAME,
+    VP_VALUE_START,
+    VP_VALUE
+};
+
+struct var_parser
+{
+    enum var_parser_state state;
+
+    char name[VAR_NAME_MAX + 1];
+    int name_len;
+    bool name_too_long;
+
+    int64_t value;
+    bool negative;
+    bool have_digits;
+    bool value_too_big;
+
+    var_packet_cb cb;
+    void *ctx;
+
+    /* How many variables have been reported */
+    int count;
+};
+
+void var_parser_init(struct var_parser *p, var_packet_cb cb, void *ctx);
+
+/* The next part of the body. Chunks can split anywhere. */
+void var_parser_feed(struct var_parser *p, const char *data, int len);
+
+/* End of the body - reports a value that ran up to the end */
+void var_parser_finish(struct var_parser *p);
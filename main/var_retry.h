@@ -0,0 +1,27 @@
+#pragma once
+
+#include "var_packet.h"
+
+/* Retry policy for link-level transports (ESP-NOW) that say whether
+ * each frame was delivered. Header only, no IDF dependencies, so
+ * tools/espnow_peer.c can run the same logic on a host. */
+
+/* Send one frame and wait for the link's verdict.
+ * Returns true if it was delivered. */
+typedef bool (*var_send_fn)(const uint8_t *buf, int len, void *ctx);
+
+/* Sends 'p' until it's delivered or 'max_sends' is used up.
+ * Returns the number of sends it took, or -1 if it never got through. */
+static inline int var_send_retry(const struct var_packet *p, int max_sends,
+                                 var_send_fn send, void *ctx)
+{
+    for(int sends = 1; sends <= max_sends; sends++)
+    {
+        if(send(p->buf, p->len, ctx))
+        {
+            return sends;
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,112 @@
+#include "wake_stub.h"
+#include "touch_confirm.h"
+
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "soc/rtc_cntl_reg.h"
+#include "soc/sens_reg.h"
+#include "esp32/rom/ets_sys.h"
+
+#define WAKE_STUB_MAX_PADS 10
+
+/* Set up by the app before sleeping; read by the stub */
+static RTC_DATA_ATTR uint8_t stub_pad_ids[WAKE_STUB_MAX_PADS];
+static RTC_DATA_ATTR uint16_t stub_thresholds[WAKE_STUB_MAX_PADS];
+static RTC_DATA_ATTR int stub_pad_count;
+static RTC_DATA_ATTR uint16_t stub_sleep_cycle;
+
+static RTC_DATA_ATTR int rejected_wakes;
+
+void wake_stub_configure(const uint8_t *pad_ids, const uint16_t *thresholds,
+                         int count, uint16_t sleep_cycle)
+{
+    if(count > WAKE_STUB_MAX_PADS)
+    {
+        count = WAKE_STUB_MAX_PADS;
+    }
+
+    for(int i = 0; i < count; i++)
+    {
+        stub_pad_ids[i] = pad_ids[i];
+        stub_thresholds[i] = thresholds[i];
+    }
+    stub_pad_count = count;
+    stub_sleep_cycle = sleep_cycle;
+}
+
+int wake_stub_rejected(void)
+{
+    int rejected = rejected_wakes;
+    rejected_wakes = 0;
+    return rejected;
+}
+
+/* Raw reading of a pad, straight from the registers
+ * (see touch_pad_slot() for which half of which register) */
+static inline __attribute__((always_inline)) uint16_t stub_read_pad(int pad)
+{
+    uint32_t both = REG_READ(SENS_SAR_TOUCH_OUT1_REG + touch_pad_reg_index(pad) * 4);
+    return touch_pad_in_low_half(pad) ? (both & 0xFFFF) : (both >> 16);
+}
+
+static inline __attribute__((always_inline)) void stub_set_sleep_cycle(uint16_t cycle)
+{
+    REG_SET_FIELD(SENS_SAR_TOUCH_CTRL2_REG, SENS_TOUCH_SLEEP_CYCLES, cycle);
+}
+
+/* Runs from RTC fast memory straight out of deep sleep, before the
+ * bootloader. Only ROM functions and RTC memory are usable here. */
+void RTC_IRAM_ATTR esp_wake_deep_sleep(void)
+{
+    esp_default_wake_deep_sleep();
+
+    if(stub_pad_count == 0)
+    {
+        /* Not configured - just boot */
+        return;
+    }
+
+    /* Sample quickly for a moment */
+    stub_set_sleep_cycle(WAKE_STUB_SAMPLE_CYCLE);
+
+    uint16_t samples[WAKE_STUB_MAX_PADS][TOUCH_CONFIRM_SAMPLES];
+
+    for(int s = 0; s < TOUCH_CONFIRM_SAMPLES; s++)
+    {
+        /* One sleep cycle (150 per ms) plus a bit, so each sample is fresh */
+        ets_delay_us(WAKE_STUB_SAMPLE_CYCLE * 1000 / 150 + 500);
+
+        for(int p = 0; p < stub_pad_count; p++)
+        {
+            samples[p][s] = stub_read_pad(stub_pad_ids[p]);
+        }
+    }
+
+    for(int p = 0; p < stub_pad_count; p++)
+    {
+        if(touch_confirm(samples[p], TOUCH_CONFIRM_SAMPLES,
+                         stub_thresholds[p], TOUCH_CONFIRM_NEEDED))
+        {
+            /* Real touch - carry on and boot */
+            return;
+        }
+    }
+
+    /* Noise. Back to sleep as if nothing happened */
+    rejected_wakes++;
+
+    stub_set_sleep_cycle(stub_sleep_cycle);
+
+    /* Clear the touch status so it doesn't wake us again straight away */
+    SET_PERI_REG_MASK(SENS_SAR_TOUCH_CTRL2_REG, SENS_TOUCH_MEAS_EN_CLR);
+
+    REG_WRITE(RTC_ENTRY_ADDR_REG, (uint32_t)&esp_wake_deep_sleep);
+    CLEAR_PERI_REG_MASK(RTC_CNTL_STATE0_REG, RTC_CNTL_SLEEP_EN);
+    SET_PERI_REG_MASK(RTC_CNTL_STATE0_REG, RTC_CNTL_SLEEP_EN);
+
+    /* A few cycles may pass before the sleep starts */
+    while(true)
+    {
+        ;
+    }
+}
@@ -0,0 +1,12 @@
+#include <stdint.h>
+
+/* The wake stub speeds up touch sampling to this while it checks */
+#define WAKE_STUB_SAMPLE_CYCLE 0x0400
+
+/* Tell the wake stub which pads to check and how, before deep sleep.
+ * 'sleep_cycle' is restored if it sends us back to sleep. */
+void wake_stub_configure(const uint8_t *pad_ids, const uint16_t *thresholds,
+                         int count, uint16_t sleep_cycle);
+
+/* Wakes the stub sent straight back to sleep since the last call */
+int wake_stub_rejected(void);
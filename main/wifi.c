@@ -0,0 +1,305 @@
+#include "wifi.h"
+#include "rf_cal.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_attr.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "lwip/inet.h"
+#include "lwip/netdb.h"
+#include <string.h>
+#include <sys/time.h>
+
+#define TAG "Wifi"
+
+#define CONNECTED_BIT BIT0
+#define GOT_IP_BIT BIT1
+#define FAIL_BIT BIT2
+
+/* Everything needed to get back on the network without a scan,
+ * DHCP or DNS. Lives in RTC memory so it survives deep sleep. */
+struct wifi_cache
+{
+    bool valid;
+    uint8_t bssid[6];
+    uint8_t channel;
+    esp_netif_ip_info_t ip_info;
+    uint32_t host_addr;
+    char host[32];
+    int wakes;
+
+    /* When DHCP gave us ip_info, by the RTC clock (which keeps
+     * running through deep sleep, unlike esp_timer) */
+    int64_t lease_time_s;
+};
+
+static RTC_DATA_ATTR struct wifi_cache cache;
+
+static EventGroupHandle_t wifi_events;
+static esp_netif_t *sta_netif;
+
+/* Set once we're on the network; disconnects after that just reconnect */
+static bool connected = false;
+
+static char host_str[32];
+
+static int64_t rtc_seconds(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec;
+}
+
+
+static void wifi_event_handler(void *arg, esp_event_base_t event_base,
+                               int32_t event_id, void *event_data)
+{
+    if(event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
+    {
+        wifi_event_sta_connected_t *event = event_data;
+
+        /* Remember where we found the AP */
+        memcpy(cache.bssid, event->bssid, sizeof(cache.bssid));
+        cache.channel = event->channel;
+
+        xEventGroupSetBits(wifi_events, CONNECTED_BIT);
+    }
+    else if(event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
+    {
+        if(connected)
+        {
+            ESP_LOGI(TAG, "Disconnected, reconnecting");
+            esp_wifi_connect();
+        }
+        else
+        {
+            xEventGroupSetBits(wifi_events, FAIL_BIT);
+        }
+    }
+    else if(event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+    {
+        ip_event_got_ip_t *event = event_data;
+        cache.ip_info = event->ip_info;
+
+        xEventGroupSetBits(wifi_events, GOT_IP_BIT);
+    }
+}
+
+static void set_sta_config(bool directed)
+{
+    wifi_config_t wifi_config = {
+        .sta = {
+            .ssid = CONFIG_EXAMPLE_WIFI_SSID,
+            .password = CONFIG_EXAMPLE_WIFI_PASSWORD,
+        },
+    };
+
+    if(directed)
+    {
+        /* Go straight to the AP we used last time */
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, cache.bssid, sizeof(cache.bssid));
+        wifi_config.sta.channel = cache.channel;
+        wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+    }
+    else
+    {
+        wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        wifi_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+    }
+
+    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
+}
+
+/* Wait for 'bit', or for a disconnect.
+ * Returns true if we got it */
+static bool wait_for(EventBits_t bit, int timeout_ms)
+{
+    EventBits_t got = xEventGroupWaitBits(wifi_events, bit | FAIL_BIT,
+                                          pdFALSE, pdFALSE,
+                                          pdMS_TO_TICKS(timeout_ms));
+    return (got & bit) != 0;
+}
+
+static bool cache_usable(void)
+{
+    if(!cache.valid || cache.ip_info.ip.addr == 0)
+    {
+        return false;
+    }
+
+    /* A clock that's gone backwards says nothing about the age */
+    int64_t age_s = rtc_seconds() - cache.lease_time_s;
+    if(age_s < 0 || age_s >= WIFI_CACHE_MAX_AGE_S)
+    {
+        ESP_LOGI(TAG, "Cached address is %lld s old, renewing", age_s);
+        return false;
+    }
+
+    return cache.wakes < WIFI_CACHE_MAX_WAKES;
+}
+
+static bool resolve_host(const char *host)
+{
+    const struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res = NULL;
+
+    if(getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL)
+    {
+        ESP_LOGE(TAG, "DNS lookup of %s failed", host);
+        return false;
+    }
+
+    cache.host_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+    freeaddrinfo(res);
+
+    strncpy(cache.host, host, sizeof(cache.host) - 1);
+    cache.host[sizeof(cache.host) - 1] = '\0';
+    return true;
+}
+
+esp_err_t wifi_connect(const char *host)
+{
+    int64_t t_start = esp_timer_get_time();
+
+    wifi_events = xEventGroupCreate();
+
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    sta_netif = esp_netif_create_default_wifi_sta();
+
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler, NULL));
+
+    /* The cache is ours - don't wear out flash with the config */
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+
+    /* The cache is only good for the host it was made for */
+    bool fast = cache_usable() && !strcmp(cache.host, host);
+
+    if(fast)
+    {
+        /* Static IP - no DHCP */
+        esp_netif_dhcpc_stop(sta_netif);
+        esp_netif_set_ip_info(sta_netif, &cache.ip_info);
+    }
+
+    set_sta_config(fast);
+
+    int64_t t_radio = esp_timer_get_time();
+    ESP_ERROR_CHECK(esp_wifi_start());
+    rf_cal_radio_started(esp_timer_get_time() - t_radio);
+
+    int64_t t_init = esp_timer_get_time();
+
+    int64_t t_assoc = 0;
+    int64_t t_ip = 0;
+    int64_t t_dns = 0;
+
+    if(fast)
+    {
+        ESP_LOGI(TAG, "Directed reconnect to channel %d (wake %d)", cache.channel, cache.wakes);
+
+        esp_wifi_connect();
+
+        if(wait_for(CONNECTED_BIT, WIFI_FAST_CONNECT_TIMEOUT_MS))
+        {
+            /* The address is already set; association is all we needed */
+            t_assoc = t_ip = t_dns = esp_timer_get_time();
+            cache.wakes++;
+        }
+        else
+        {
+            ESP_LOGI(TAG, "Directed reconnect failed, doing a full connect");
+            fast = false;
+            cache.valid = false;
+
+            esp_wifi_disconnect();
+            xEventGroupClearBits(wifi_events, CONNECTED_BIT | GOT_IP_BIT | FAIL_BIT);
+
+            set_sta_config(false);
+            esp_netif_dhcpc_start(sta_netif);
+        }
+    }
+
+    if(!fast)
+    {
+        cache.valid = false;
+
+        int attempts = 0;
+        do
+        {
+            if(attempts++ == WIFI_MAX_RETRIES)
+            {
+                ESP_LOGE(TAG, "Couldn't associate");
+                return ESP_ERR_TIMEOUT;
+            }
+
+            xEventGroupClearBits(wifi_events, FAIL_BIT);
+            esp_wifi_connect();
+        }
+        while(!wait_for(CONNECTED_BIT, WIFI_FULL_CONNECT_TIMEOUT_MS));
+
+        t_assoc = esp_timer_get_time();
+
+        if(!wait_for(GOT_IP_BIT, WIFI_FULL_CONNECT_TIMEOUT_MS))
+        {
+            ESP_LOGE(TAG, "No IP address");
+            return ESP_ERR_TIMEOUT;
+        }
+        t_ip = esp_timer_get_time();
+
+        /* Not in the event handler - a static IP gets that event too,
+         * and it mustn't look like a new lease */
+        cache.lease_time_s = rtc_seconds();
+
+        bool resolved = resolve_host(host);
+        t_dns = esp_timer_get_time();
+
+        /* Without the host address there's no point being fast */
+        cache.valid = resolved;
+        cache.wakes = 0;
+    }
+
+    connected = true;
+
+    if(cache.valid)
+    {
+        struct in_addr addr = { .s_addr = cache.host_addr };
+        inet_ntoa_r(addr, host_str, sizeof(host_str));
+    }
+    else
+    {
+        strncpy(host_str, host, sizeof(host_str) - 1);
+    }
+
+    ESP_LOGI(TAG, "Connected (%s): init %lld us, assoc %lld us, ip %lld us, dns %lld us, total %lld us",
+             fast ? "fast" : "full",
+             t_init - t_start,
+             t_assoc - t_init,
+             t_ip - t_assoc,
+             t_dns - t_ip,
+             t_dns - t_start);
+
+    return ESP_OK;
+}
+
+const char *wifi_host(void)
+{
+    return host_str;
+}
+
+void wifi_invalidate_cache(void)
+{
+    cache.valid = false;
+}
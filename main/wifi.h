@@ -0,0 +1,34 @@
+#include <stdbool.h>
+#include "esp_err.h"
+
+/* How long to wait for a directed (cached BSSID/channel/IP) reconnect
+ * before giving up and doing a full scan + DHCP */
+#define WIFI_FAST_CONNECT_TIMEOUT_MS 1500
+
+/* How long a full connect (scan, association, DHCP) may take */
+#define WIFI_FULL_CONNECT_TIMEOUT_MS 15000
+
+/* Association attempts before a full connect gives up */
+#define WIFI_MAX_RETRIES 5
+
+/* The fast path reuses the DHCP address as a static IP, which is only
+ * ours until the lease runs out. Do a full connect (and so a fresh
+ * lease) once the address is this old, well inside the hour or more
+ * that routers typically hand out, even if the fast path keeps working */
+#define WIFI_CACHE_MAX_AGE_S (30 * 60)
+
+/* ...and after this many wakes, whatever the clock says */
+#define WIFI_CACHE_MAX_WAKES 200
+
+/* Connect to the AP configured in menuconfig.
+ * Uses the cache in RTC memory when it's good, otherwise scans,
+ * does DHCP, resolves 'host' and refreshes the cache. */
+esp_err_t wifi_connect(const char *host);
+
+/* Address of the host passed to wifi_connect, as a dotted quad.
+ * Falls back to the host name if it couldn't be resolved. */
+const char *wifi_host(void);
+
+/* Forget the cache, so the next wake does a full connect.
+ * Call this when the cached host address stops answering. */
+void wifi_invalidate_cache(void);
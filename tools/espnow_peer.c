@@ -0,0 +1,200 @@
+/* Host stand-in for the ESP-NOW link, so the framing and retry logic
+ * can be exercised off-device. UDP on localhost plays the part of the
+ * air; a one byte reply plays the part of the MAC-layer ack that drives
+ * the send callback on the ESP32.
+ *
+ * Build:
+ *   cc -O2 -Imain -o espnow_peer tools/espnow_peer.c main/var_packet.c
+ *
+ * Run the peer, losing frames and acks with some probability:
+ *   ./espnow_peer peer [loss_percent] [port]
+ *
+ * Send updates to it through the same retry policy the firmware uses:
+ *   ./espnow_peer send [count] [port]
+ */
+
+#include "var_packet.h"
+#include "var_retry.h"
+#include "espnow_vars.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 8267
+
+/* What the peer sends back for a frame it received */
+#define MAC_ACK 0x06
+
+static void print_var(const char *name, int32_t value, void *ctx)
+{
+    printf(" %s=%d", name, value);
+}
+
+static int peer_main(int loss_percent, int port)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+
+    if(sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("bind");
+        return 1;
+    }
+
+    printf("peer on udp port %d, losing %d%% of frames and acks\n", port, loss_percent);
+    fflush(stdout);
+
+    /* A lost ack means the sender resends a frame we already have.
+     * One sender, so its epoch + seq identify a frame */
+    int last_epoch = -1, last_seq = -1;
+    long frames = 0, lost = 0, dups = 0, bad = 0;
+
+    for(;;)
+    {
+        uint8_t buf[VAR_PACKET_MAX + 1];
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+
+        int len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+        if(len < 0)
+        {
+            continue;
+        }
+
+        if(rand() % 100 < loss_percent)
+        {
+            /* Never arrived */
+            lost++;
+            continue;
+        }
+
+        struct var_packet_header hdr;
+        if(len > VAR_PACKET_MAX || !var_packet_parse(buf, len, &hdr, NULL, NULL))
+        {
+            bad++;
+            continue;
+        }
+
+        if(rand() % 100 >= loss_percent)
+        {
+            uint8_t ack = MAC_ACK;
+            sendto(sock, &ack, 1, 0, (struct sockaddr *)&from, from_len);
+        }
+
+        if(hdr.epoch == last_epoch && hdr.seq == last_seq)
+        {
+            dups++;
+            continue;
+        }
+        last_epoch = hdr.epoch;
+        last_seq = hdr.seq;
+        frames++;
+
+        printf("epoch=%d seq=%d:", hdr.epoch, hdr.seq);
+        var_packet_parse(buf, len, &hdr, print_var, NULL);
+        printf("  (%ld frames, %ld lost, %ld dups, %ld bad)\n", frames, lost, dups, bad);
+        fflush(stdout);
+    }
+}
+
+struct link
+{
+    int sock;
+    struct sockaddr_in dest;
+};
+
+/* Same contract as the firmware's send_once(): true if MAC-acked */
+static bool send_once(const uint8_t *buf, int len, void *ctx)
+{
+    struct link *link = ctx;
+
+    sendto(link->sock, buf, len, 0, (struct sockaddr *)&link->dest, sizeof(link->dest));
+
+    uint8_t ack;
+    return recv(link->sock, &ack, 1, 0) == 1 && ack == MAC_ACK;
+}
+
+static int send_main(int count, int port)
+{
+    struct link link = {
+        .sock = socket(AF_INET, SOCK_DGRAM, 0),
+        .dest = {
+            .sin_family = AF_INET,
+            .sin_port = htons(port),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        },
+    };
+
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = ESPNOW_SEND_TIMEOUT_MS * 1000 };
+    setsockopt(link.sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    /* Each run is like a power on: seq starts again, so pick a new epoch */
+    uint8_t epoch = 1 + (time(NULL) ^ getpid()) % 255;
+
+    int delivered = 0, failed = 0, total_sends = 0;
+    int histogram[ESPNOW_MAX_SENDS + 1] = {0};
+
+    for(int i = 0; i < count; i++)
+    {
+        /* Like a state change: two variables in one frame */
+        struct var_packet p;
+        var_packet_init(&p, i, 0);
+        var_packet_set_epoch(&p, epoch);
+        var_packet_add(&p, "solid_mode", i & 1);
+        var_packet_add(&p, "col", i * 0x010101);
+
+        int sends = var_send_retry(&p, ESPNOW_MAX_SENDS, send_once, &link);
+        if(sends > 0)
+        {
+            delivered++;
+            total_sends += sends;
+            histogram[sends]++;
+        }
+        else
+        {
+            failed++;
+            total_sends += ESPNOW_MAX_SENDS;
+        }
+    }
+
+    printf("%d delivered, %d failed, %.2f sends per packet\n",
+           delivered, failed, (double)total_sends / count);
+    for(int s = 1; s <= ESPNOW_MAX_SENDS; s++)
+    {
+        printf("  delivered on send %d: %d\n", s, histogram[s]);
+    }
+
+    close(link.sock);
+    return failed ? 2 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc >= 2 && !strcmp(argv[1], "peer"))
+    {
+        return peer_main(argc >= 3 ? atoi(argv[2]) : 0,
+                         argc >= 4 ? atoi(argv[3]) : DEFAULT_PORT);
+    }
+
+    if(argc >= 2 && !strcmp(argv[1], "send"))
+    {
+        return send_main(argc >= 3 ? atoi(argv[2]) : 100,
+                         argc >= 4 ? atoi(argv[3]) : DEFAULT_PORT);
+    }
+
+    fprintf(stderr,
+            "usage: %s peer [loss_percent] [port]\n"
+            "       %s send [count] [port]\n",
+            argv[0], argv[0]);
+    return 1;
+}
@@ -0,0 +1,330 @@
+/* Correlates device latency traces with received frames and prints
+ * per-stage latency histograms.
+ *
+ * Build:
+ *   cc -O2 -o latency_report tools/latency_report.c
+ *
+ * Feed it any mix of (other lines are ignored):
+ *   - the device's serial log, for its "LAT gid=.. wake=.. touch=.. down=.. edge=.. send=.. radio=.." lines
+ *   - "RX gid=.. touch_ms=.. rx_us=.." lines, from tools/udp_receiver.c or a
+ *     BLE capture (gid = iBeacon major, touch_ms = minor) - down_us/edge_us/send_us are optional
+ *
+ *   ./latency_report device.log rx.log
+ *
+ * Stages (all us):
+ *   touch     wake from deep sleep -> touch known to the app (0 if we were awake)
+ *   debounce  touch -> debounce confirmed the press
+ *   hold      press -> debounced edge that triggered the update (the
+ *             release, for a tap) - how long the finger was down, not
+ *             something the firmware can make faster
+ *   task      edge -> request task sending
+ *   hci       sending -> handed to the radio
+ *   air       radio -> received
+ *
+ * The device and host clocks aren't synchronised, so 'air' is relative:
+ * the offset between them is taken from the fastest frame, which therefore
+ * shows as 0. Compare shapes and percentiles between runs, not absolutes.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_GESTURES 65536
+
+enum stage
+{
+    STAGE_TOUCH,
+    STAGE_DEBOUNCE,
+    STAGE_HOLD,
+    STAGE_TASK,
+    STAGE_HCI,
+    STAGE_AIR,
+    STAGE_TOTAL,
+    STAGE_MAX
+};
+
+static const char *stage_names[STAGE_MAX] = {
+    "touch", "debounce", "hold", "task", "hci", "air", "total"
+};
+
+struct gesture
+{
+    /* From the device log */
+    int have_lat;
+    int64_t wake, touch, down, edge, send, radio;
+
+    /* From the receiver - first frame of the gesture only */
+    int have_rx;
+    uint32_t touch_ms;
+    int have_rel;
+    int64_t down_rel, edge_rel, send_rel;
+    int64_t rx;
+};
+
+static struct gesture gestures[MAX_GESTURES];
+
+struct samples
+{
+    int64_t *v;
+    int n, cap;
+};
+
+static struct samples stages[STAGE_MAX];
+
+static void add_sample(enum stage s, int64_t us)
+{
+    struct samples *st = &stages[s];
+    if(st->n == st->cap)
+    {
+        st->cap = st->cap ? st->cap * 2 : 256;
+        st->v = realloc(st->v, st->cap * sizeof(*st->v));
+    }
+    st->v[st->n++] = us;
+}
+
+/* Pull "key=<int>" out of a line */
+static int get_field(const char *line, const char *key, long long *out)
+{
+    char pat[32];
+    snprintf(pat, sizeof(pat), "%s=", key);
+
+    for(const char *p = strstr(line, pat); p; p = strstr(p + 1, pat))
+    {
+        /* Whole keys only - "touch" mustn't match "touch_ms" or "xtouch" */
+        if(p == line || p[-1] == ' ')
+        {
+            *out = strtoll(p + strlen(pat), NULL, 10);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void parse_line(const char *line)
+{
+    long long gid, v;
+
+    const char *lat = strstr(line, "LAT gid=");
+    if(lat)
+    {
+        /* The device logs each frame of a gesture; keep the first */
+        if(!get_field(lat, "gid", &gid) || gestures[gid & 0xFFFF].have_lat)
+        {
+            return;
+        }
+
+        struct gesture *g = &gestures[gid & 0xFFFF];
+        if(get_field(lat, "wake", &v)) g->wake = v; else return;
+        if(get_field(lat, "touch", &v)) g->touch = v; else return;
+        if(get_field(lat, "down", &v)) g->down = v; else return;
+        if(get_field(lat, "edge", &v)) g->edge = v; else return;
+        if(get_field(lat, "send", &v)) g->send = v; else return;
+        if(get_field(lat, "radio", &v)) g->radio = v; else return;
+        g->have_lat = 1;
+        return;
+    }
+
+    const char *rx = strstr(line, "RX gid=");
+    if(rx)
+    {
+        if(!get_field(rx, "gid", &gid) || gestures[gid & 0xFFFF].have_rx)
+        {
+            return;
+        }
+
+        struct gesture *g = &gestures[gid & 0xFFFF];
+        if(!get_field(rx, "rx_us", &v))
+        {
+            return;
+        }
+        g->rx = v;
+
+        if(get_field(rx, "touch_ms", &v))
+        {
+            g->touch_ms = v;
+        }
+
+        long long d, e, s;
+        if(get_field(rx, "down_us", &d) &&
+           get_field(rx, "edge_us", &e) && get_field(rx, "send_us", &s))
+        {
+            g->down_rel = d;
+            g->edge_rel = e;
+            g->send_rel = s;
+            g->have_rel = 1;
+        }
+        g->have_rx = 1;
+    }
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void histogram(enum stage s)
+{
+    static const int64_t bounds_us[] = {
+        1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000
+    };
+    const int nbounds = sizeof(bounds_us) / sizeof(bounds_us[0]);
+
+    struct samples *st = &stages[s];
+    printf("\n%s: ", stage_names[s]);
+    if(st->n == 0)
+    {
+        printf("no samples\n");
+        return;
+    }
+
+    qsort(st->v, st->n, sizeof(*st->v), cmp_i64);
+    printf("n=%d  p50 %lld  p90 %lld  p99 %lld  max %lld us\n",
+           st->n,
+           (long long)st->v[st->n / 2],
+           (long long)st->v[(st->n * 9) / 10],
+           (long long)st->v[(st->n * 99) / 100],
+           (long long)st->v[st->n - 1]);
+
+    int counts[sizeof(bounds_us) / sizeof(bounds_us[0]) + 1] = {0};
+    int most = 0;
+    for(int i = 0; i < st->n; i++)
+    {
+        int b = 0;
+        while(b < nbounds && st->v[i] >= bounds_us[b])
+        {
+            b++;
+        }
+        if(++counts[b] > most)
+        {
+            most = counts[b];
+        }
+    }
+
+    for(int b = 0; b <= nbounds; b++)
+    {
+        char label[32];
+        if(b < nbounds)
+        {
+            snprintf(label, sizeof(label), "< %lld ms", (long long)bounds_us[b] / 1000);
+        }
+        else
+        {
+            snprintf(label, sizeof(label), ">= %lld ms", (long long)bounds_us[nbounds - 1] / 1000);
+        }
+
+        int bar = counts[b] * 50 / most;
+        printf("  %10s %6d ", label, counts[b]);
+        for(int i = 0; i < bar; i++)
+        {
+            putchar('#');
+        }
+        putchar('\n');
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: %s <log>...  (- for stdin)\n", argv[0]);
+        return 1;
+    }
+
+    for(int i = 1; i < argc; i++)
+    {
+        FILE *f = strcmp(argv[i], "-") ? fopen(argv[i], "r") : stdin;
+        if(!f)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+
+        char line[1024];
+        while(fgets(line, sizeof(line), f))
+        {
+            parse_line(line);
+        }
+
+        if(f != stdin)
+        {
+            fclose(f);
+        }
+    }
+
+    /* Clock offset: the smallest rx - radio we saw */
+    int have_offset = 0;
+    int64_t offset = 0;
+    for(int i = 0; i < MAX_GESTURES; i++)
+    {
+        struct gesture *g = &gestures[i];
+        if(g->have_lat && g->have_rx &&
+           (g->touch_ms & 0xFFFF) == ((g->touch / 1000) & 0xFFFF))
+        {
+            int64_t d = g->rx - g->radio;
+            if(!have_offset || d < offset)
+            {
+                offset = d;
+                have_offset = 1;
+            }
+        }
+    }
+
+    int device_only = 0, rx_only = 0, matched = 0;
+
+    for(int i = 0; i < MAX_GESTURES; i++)
+    {
+        struct gesture *g = &gestures[i];
+
+        if(g->have_lat)
+        {
+            add_sample(STAGE_TOUCH, g->touch - g->wake);
+            add_sample(STAGE_DEBOUNCE, g->down - g->touch);
+            add_sample(STAGE_HOLD, g->edge - g->down);
+            add_sample(STAGE_TASK, g->send - g->edge);
+            add_sample(STAGE_HCI, g->radio - g->send);
+        }
+        else if(g->have_rx && g->have_rel)
+        {
+            /* No device log, but the frame says how far it got */
+            add_sample(STAGE_DEBOUNCE, g->down_rel);
+            add_sample(STAGE_HOLD, g->edge_rel - g->down_rel);
+            add_sample(STAGE_TASK, g->send_rel - g->edge_rel);
+        }
+
+        if(g->have_lat && g->have_rx && have_offset &&
+           (g->touch_ms & 0xFFFF) == ((g->touch / 1000) & 0xFFFF))
+        {
+            int64_t air = g->rx - g->radio - offset;
+            add_sample(STAGE_AIR, air);
+            add_sample(STAGE_TOTAL, g->radio - g->wake + air);
+            matched++;
+        }
+        else if(g->have_lat)
+        {
+            add_sample(STAGE_TOTAL, g->radio - g->wake);
+            device_only++;
+        }
+        else if(g->have_rx)
+        {
+            rx_only++;
+        }
+    }
+
+    printf("%d gestures matched, %d device-only, %d received-only\n",
+           matched, device_only, rx_only);
+    if(have_offset)
+    {
+        printf("clock offset (host - device) %lld us, from the fastest frame\n", (long long)offset);
+    }
+
+    for(int s = 0; s < STAGE_MAX; s++)
+    {
+        histogram(s);
+    }
+
+    return 0;
+}
@@ -0,0 +1,132 @@
+/* Host test for the wake stub's touch decision (main/touch_confirm.h),
+ * and for where it finds each pad's reading.
+ *
+ * Build and run:
+ *   cc -O2 -Imain -o touch_confirm_test tools/touch_confirm_test.c
+ *   ./touch_confirm_test
+ *
+ * Exits non-zero if any case fails.
+ */
+
+#include "touch_confirm.h"
+
+#include <stdio.h>
+
+#define THRESHOLD 400
+
+/* Well clear of the threshold either way */
+#define UP 800
+#define DOWN 200
+
+struct test_case
+{
+    const char *name;
+    uint16_t samples[TOUCH_CONFIRM_SAMPLES];
+    bool expected;
+};
+
+static const struct test_case cases[] = {
+    /* Finger stayed on the pad - boot */
+    { "persistent",   { DOWN, DOWN, DOWN }, true },
+
+    /* Touched at the wake, gone by the end - a brush or noise spike */
+    { "released",     { DOWN, DOWN, UP },   false },
+
+    /* Only caught in the last sample - not enough of the window */
+    { "late",         { UP, UP, DOWN },     false },
+
+    /* Arrived a sample late but stayed - enough */
+    { "late but held", { UP, DOWN, DOWN },   true },
+
+    /* Flickering around the threshold (e.g. water on the pad) */
+    { "intermittent", { DOWN, UP, DOWN },   true },
+    { "mostly up",    { UP, DOWN, UP },     false },
+
+    /* Nothing there at all */
+    { "untouched",    { UP, UP, UP },       false },
+
+    /* A reading of 0 means the FSM hadn't measured the pad - let the app decide */
+    { "unmeasured",   { 0, UP, UP },        true },
+    { "unmeasured last", { UP, UP, 0 },     true },
+
+    /* Exactly at the threshold isn't touched */
+    { "at threshold", { THRESHOLD, THRESHOLD, THRESHOLD }, false },
+    { "just below",   { THRESHOLD - 1, THRESHOLD - 1, THRESHOLD - 1 }, true },
+};
+
+/* Register (from SENS_SAR_TOUCH_OUT1_REG) and half for each pad,
+ * as IDF's touch_ll_read_raw_data() has them */
+static const struct
+{
+    int pad;
+    int reg;
+    bool low_half;
+} slots[] = {
+    { 0, 0, false },
+    { 1, 0, true },
+    { 2, 1, false },
+    { 7, 3, true },
+    /* 8 and 9 are swapped */
+    { 8, 4, true },
+    { 9, 4, false },
+};
+
+static int check_slots(void)
+{
+    int failed = 0;
+    int count = sizeof(slots) / sizeof(slots[0]);
+
+    for(int i = 0; i < count; i++)
+    {
+        int reg = touch_pad_reg_index(slots[i].pad);
+        bool low = touch_pad_in_low_half(slots[i].pad);
+        bool ok = reg == slots[i].reg && low == slots[i].low_half;
+
+        printf("pad %d            -> OUT%d %-4s   %s\n", slots[i].pad,
+               reg + 1, low ? "low" : "high", ok ? "ok" : "FAILED");
+
+        if(!ok)
+        {
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+int main(void)
+{
+    int failed = 0;
+    int count = sizeof(cases) / sizeof(cases[0]);
+
+    for(int i = 0; i < count; i++)
+    {
+        const struct test_case *c = &cases[i];
+        bool got = touch_confirm(c->samples, TOUCH_CONFIRM_SAMPLES,
+                                 THRESHOLD, TOUCH_CONFIRM_NEEDED);
+
+        printf("%-16s %4d %4d %4d  -> %-6s %s\n", c->name,
+               c->samples[0], c->samples[1], c->samples[2],
+               got ? "boot" : "reject",
+               got == c->expected ? "ok" : "FAILED");
+
+        if(got != c->expected)
+        {
+            failed++;
+        }
+    }
+
+    /* No samples at all can't confirm anything */
+    uint16_t none[1] = { DOWN };
+    if(touch_confirm(none, 0, THRESHOLD, TOUCH_CONFIRM_NEEDED))
+    {
+        printf("no samples       -> boot FAILED\n");
+        failed++;
+    }
+
+    int slot_count = sizeof(slots) / sizeof(slots[0]);
+    failed += check_slots();
+
+    printf("%d/%d passed\n", count + 1 + slot_count - failed, count + 1 + slot_count);
+    return failed ? 1 : 0;
+}
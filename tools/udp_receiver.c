@@ -0,0 +1,360 @@
+/* Linux stand-in for the UDP variable receiver, plus a benchmark that
+ * compares the UDP path against the HTTP one.
+ *
+ * Build:
+ *   cc -O2 -Imain -o udp_receiver tools/udp_receiver.c main/var_packet.c
+ *
+ * Receive (and ack) updates from the remote:
+ *   ./udp_receiver listen [port]
+ *
+ * Compare latency/throughput of UDP vs HTTP against a receiver + server:
+ *   ./udp_receiver bench <host> [count] [var]
+ */
+
+#include "var_packet.h"
+#include "udp_vars.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HTTP_PORT 8080
+
+#define MAX_SENDERS 16
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Comparable with the device's timestamps (which are wall clock too) */
+static int64_t wall_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void print_var(const char *name, int32_t value, void *ctx)
+{
+    printf(" %s=%d", name, value);
+}
+
+/* The last packet seen from each sender. The source port changes from wake
+ * to wake, so a sender is its address; epoch + seq say which packet. */
+struct sender
+{
+    struct in_addr addr;
+    uint8_t epoch;
+    uint16_t seq;
+};
+
+static struct sender senders[MAX_SENDERS];
+static int sender_count = 0;
+
+/* True if this is a resend of the last packet from 'addr'; remembers it if not */
+static int is_duplicate(struct in_addr addr, const struct var_packet_header *hdr)
+{
+    struct sender *s = NULL;
+    for(int i = 0; i < sender_count; i++)
+    {
+        if(senders[i].addr.s_addr == addr.s_addr)
+        {
+            s = &senders[i];
+            break;
+        }
+    }
+
+    if(s && s->epoch == hdr->epoch && s->seq == hdr->seq)
+    {
+        return 1;
+    }
+
+    if(!s)
+    {
+        /* Full - forget the oldest */
+        if(sender_count == MAX_SENDERS)
+        {
+            memmove(senders, senders + 1, (MAX_SENDERS - 1) * sizeof(*senders));
+            sender_count--;
+        }
+        s = &senders[sender_count++];
+        s->addr = addr;
+    }
+
+    s->epoch = hdr->epoch;
+    s->seq = hdr->seq;
+    return 0;
+}
+
+static int listen_main(int port)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    if(sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("bind");
+        return 1;
+    }
+
+    printf("listening on udp port %d\n", port);
+
+    /* Resends of a packet we've already seen are acked but not reported */
+    long packets = 0, dups = 0, bad = 0;
+    int64_t t_first = 0;
+
+    for(;;)
+    {
+        uint8_t buf[VAR_PACKET_MAX];
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+
+        int len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+        if(len < 0)
+        {
+            perror("recvfrom");
+            continue;
+        }
+
+        int64_t t = now_us();
+        if(t_first == 0)
+        {
+            t_first = t;
+        }
+
+        struct var_packet_header hdr;
+        if(!var_packet_parse(buf, len, &hdr, NULL, NULL))
+        {
+            bad++;
+            continue;
+        }
+
+        if(hdr.flags & VAR_FLAG_ACK_REQ)
+        {
+            struct var_packet ack;
+            var_packet_init(&ack, hdr.seq, VAR_FLAG_ACK);
+            sendto(sock, ack.buf, ack.len, 0, (struct sockaddr *)&from, from_len);
+        }
+
+        if(is_duplicate(from.sin_addr, &hdr))
+        {
+            dups++;
+            continue;
+        }
+        packets++;
+
+        printf("%lld.%06lld %s epoch=%d seq=%d%s:",
+               (long long)(t / 1000000), (long long)(t % 1000000),
+               inet_ntoa(from.sin_addr), hdr.epoch, hdr.seq,
+               (hdr.flags & VAR_FLAG_ACK_REQ) ? " (ack)" : "");
+        var_packet_parse(buf, len, &hdr, print_var, NULL);
+        printf("\n");
+
+        if(hdr.flags & VAR_FLAG_TRACE)
+        {
+            /* For tools/latency_report.c */
+            printf("RX gid=%u touch_ms=%u down_us=%u edge_us=%u send_us=%u rx_us=%lld\n",
+                   hdr.trace.gesture_id, hdr.trace.touch_ms, hdr.trace.down_us,
+                   hdr.trace.edge_us, hdr.trace.send_us,
+                   (long long)wall_us());
+        }
+
+        if(packets % 100 == 0)
+        {
+            double secs = (t - t_first) / 1e6;
+            printf("-- %ld packets, %ld dups, %ld bad, %.1f packets/s\n",
+                   packets, dups, bad, secs > 0 ? packets / secs : 0);
+        }
+        fflush(stdout);
+    }
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *what, int64_t *lat, int n, int failed, int64_t total_us)
+{
+    if(n == 0)
+    {
+        printf("%-5s no successful updates (%d failed)\n", what, failed);
+        return;
+    }
+
+    qsort(lat, n, sizeof(*lat), cmp_i64);
+
+    int64_t sum = 0;
+    for(int i = 0; i < n; i++)
+    {
+        sum += lat[i];
+    }
+
+    printf("%-5s n=%d failed=%d  min %lld  p50 %lld  p99 %lld  max %lld  mean %lld us  %.1f updates/s\n",
+           what, n, failed,
+           (long long)lat[0], (long long)lat[n / 2], (long long)lat[(n * 99) / 100],
+           (long long)lat[n - 1], (long long)(sum / n),
+           n * 1e6 / total_us);
+}
+
+/* One acked UDP update. Returns latency in us, or -1 */
+static int64_t udp_update(int sock, struct sockaddr_in *dest, uint16_t seq,
+                          const char *var, int value)
+{
+    struct var_packet p;
+    var_packet_init(&p, seq, VAR_FLAG_ACK_REQ);
+    var_packet_add(&p, var, value);
+
+    int64_t t = now_us();
+
+    for(int send = 0; send < UDP_MAX_SENDS; send++)
+    {
+        sendto(sock, p.buf, p.len, 0, (struct sockaddr *)dest, sizeof(*dest));
+
+        uint8_t buf[VAR_PACKET_MAX];
+        int len;
+        while((len = recv(sock, buf, sizeof(buf), 0)) >= 0)
+        {
+            struct var_packet_header hdr;
+            if(var_packet_parse(buf, len, &hdr, NULL, NULL) &&
+               (hdr.flags & VAR_FLAG_ACK) && hdr.seq == seq)
+            {
+                return now_us() - t;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/* One HTTP GET the way http_set_int_var does it: new connection,
+ * whole response read. Returns latency in us, or -1 */
+static int64_t http_update(struct sockaddr_in *dest, const char *host,
+                           const char *var, int value)
+{
+    int64_t t = now_us();
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock < 0 || connect(sock, (struct sockaddr *)dest, sizeof(*dest)) < 0)
+    {
+        if(sock >= 0)
+        {
+            close(sock);
+        }
+        return -1;
+    }
+
+    char req[256];
+    int len = snprintf(req, sizeof(req),
+                       "GET /vars/%s?set=%d HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                       var, value, host);
+    if(write(sock, req, len) != len)
+    {
+        close(sock);
+        return -1;
+    }
+
+    char buf[4096];
+    while(read(sock, buf, sizeof(buf)) > 0)
+        ;
+    close(sock);
+
+    return now_us() - t;
+}
+
+static int bench_main(const char *host, int count, const char *var)
+{
+    struct addrinfo hints = { .ai_family = AF_INET }, *res;
+    if(getaddrinfo(host, NULL, &hints, &res) != 0)
+    {
+        fprintf(stderr, "can't resolve %s\n", host);
+        return 1;
+    }
+
+    struct sockaddr_in udp_dest = *(struct sockaddr_in *)res->ai_addr;
+    struct sockaddr_in http_dest = udp_dest;
+    freeaddrinfo(res);
+
+    udp_dest.sin_port = htons(UDP_VARS_PORT);
+    http_dest.sin_port = htons(HTTP_PORT);
+
+    int64_t *lat = calloc(count, sizeof(*lat));
+
+    /* UDP */
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = UDP_ACK_TIMEOUT_MS * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int n = 0, failed = 0;
+    int64_t t_start = now_us();
+    for(int i = 0; i < count; i++)
+    {
+        int64_t l = udp_update(sock, &udp_dest, i, var, i);
+        if(l < 0)
+        {
+            failed++;
+        }
+        else
+        {
+            lat[n++] = l;
+        }
+    }
+    report("udp", lat, n, failed, now_us() - t_start);
+    close(sock);
+
+    /* HTTP */
+    n = 0;
+    failed = 0;
+    t_start = now_us();
+    for(int i = 0; i < count; i++)
+    {
+        int64_t l = http_update(&http_dest, host, var, i);
+        if(l < 0)
+        {
+            failed++;
+        }
+        else
+        {
+            lat[n++] = l;
+        }
+    }
+    report("http", lat, n, failed, now_us() - t_start);
+
+    free(lat);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc >= 2 && !strcmp(argv[1], "listen"))
+    {
+        return listen_main(argc >= 3 ? atoi(argv[2]) : UDP_VARS_PORT);
+    }
+
+    if(argc >= 3 && !strcmp(argv[1], "bench"))
+    {
+        return bench_main(argv[2],
+                          argc >= 4 ? atoi(argv[3]) : 200,
+                          argc >= 5 ? argv[4] : "bench");
+    }
+
+    fprintf(stderr,
+            "usage: %s listen [port]\n"
+            "       %s bench <host> [count] [var]\n",
+            argv[0], argv[0]);
+    return 1;
+}
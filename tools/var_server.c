@@ -0,0 +1,355 @@
+/* Stand-in for the HTTP variable server, and a benchmark of reading its
+ * responses the way the firmware does (main/var_parser.c).
+ *
+ * Build:
+ *   cc -O2 -Imain -o var_server tools/var_server.c main/var_parser.c
+ *
+ * Serve GET /vars/<name>[?set=<int>], answering with every variable as
+ * JSON, padded out to at least body_bytes so responses can be made big:
+ *   ./var_server serve [port] [body_bytes]
+ *
+ * Set a variable 'count' times and read each value back out of the
+ * response, a receive buffer at a time:
+ *   ./var_server bench <host> [count] [port]
+ *
+ * The bench also says how many responses the old approach (copy the whole
+ * body into a 2 KB buffer) would have overrun.
+ */
+
+#include "var_parser.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 8080
+
+/* esp_http_client's default receive buffer */
+#define RX_BUFFER_SIZE 512
+
+/* What http_colors.c used to copy the body into */
+#define OLD_BODY_BUFFER 2048
+
+#define MAX_VARS 32
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct server_var
+{
+    char name[VAR_NAME_MAX + 1];
+    int value;
+};
+
+static struct server_var vars[MAX_VARS];
+static int var_count = 0;
+
+static struct server_var *find_var(const char *name, int create)
+{
+    for(int i = 0; i < var_count; i++)
+    {
+        if(!strcmp(vars[i].name, name))
+        {
+            return &vars[i];
+        }
+    }
+
+    if(!create || var_count == MAX_VARS)
+    {
+        return NULL;
+    }
+
+    struct server_var *v = &vars[var_count++];
+    snprintf(v->name, sizeof(v->name), "%s", name);
+    v->value = 0;
+    return v;
+}
+
+static void handle(int conn, int body_bytes)
+{
+    char req[1024];
+    int len = 0, n;
+
+    /* Just the request line and headers */
+    while(len < (int)sizeof(req) - 1 &&
+          (n = read(conn, req + len, sizeof(req) - 1 - len)) > 0)
+    {
+        len += n;
+        req[len] = '\0';
+        if(strstr(req, "\r\n\r\n"))
+        {
+            break;
+        }
+    }
+    req[len] = '\0';
+
+    char name[VAR_NAME_MAX + 1];
+    int status = 200;
+
+    if(sscanf(req, "GET /vars/%19[A-Za-z0-9_]", name) == 1)
+    {
+        char *set = strstr(req, "?set=");
+        char *eol = strstr(req, "\r\n");
+        if(set && (!eol || set < eol))
+        {
+            find_var(name, 1)->value = atoi(set + 5);
+        }
+        else if(!find_var(name, 0))
+        {
+            status = 404;
+        }
+    }
+    else
+    {
+        status = 400;
+    }
+
+    /* Padding first, so the variables are at the far end of a big body */
+    char *body = malloc(body_bytes + MAX_VARS * 48 + 64);
+    int blen = sprintf(body, "{\"padding\": \"");
+    int vars_len = 2 + var_count * (VAR_NAME_MAX + 20);
+    while(blen < body_bytes - vars_len)
+    {
+        body[blen++] = 'x';
+    }
+    blen += sprintf(body + blen, "\"");
+    for(int i = 0; i < var_count; i++)
+    {
+        blen += sprintf(body + blen, ", \"%s\": %d", vars[i].name, vars[i].value);
+    }
+    blen += sprintf(body + blen, "}\n");
+
+    char head[256];
+    int hlen = snprintf(head, sizeof(head),
+                        "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\n"
+                        "Content-Length: %d\r\nConnection: close\r\n\r\n",
+                        status, status == 200 ? "OK" : "Error", blen);
+
+    if(write(conn, head, hlen) != hlen || write(conn, body, blen) != blen)
+    {
+        perror("write");
+    }
+    free(body);
+}
+
+static int serve_main(int port, int body_bytes)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    if(sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 8) < 0)
+    {
+        perror("bind");
+        return 1;
+    }
+
+    printf("serving on tcp port %d, bodies of at least %d bytes\n", port, body_bytes);
+    fflush(stdout);
+
+    for(;;)
+    {
+        int conn = accept(sock, NULL, NULL);
+        if(conn < 0)
+        {
+            continue;
+        }
+        handle(conn, body_bytes);
+        close(conn);
+    }
+}
+
+struct readback
+{
+    const char *name;
+    int value;
+    int found;
+};
+
+static void check_var(const char *name, int32_t value, void *ctx)
+{
+    struct readback *rb = ctx;
+    if(!strcmp(name, rb->name))
+    {
+        rb->value = value;
+        rb->found = 1;
+    }
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* One set, parsed as it arrives. Returns round trip in ns, or -1 */
+static int64_t set_and_read(struct sockaddr_in *dest, const char *host,
+                            const char *var, int value,
+                            int64_t *parse_ns, int *body_len, int *correct)
+{
+    int64_t t = now_ns();
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock < 0 || connect(sock, (struct sockaddr *)dest, sizeof(*dest)) < 0)
+    {
+        if(sock >= 0)
+        {
+            close(sock);
+        }
+        return -1;
+    }
+
+    char req[256];
+    int len = snprintf(req, sizeof(req),
+                       "GET /vars/%s?set=%d HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                       var, value, host);
+    if(write(sock, req, len) != len)
+    {
+        close(sock);
+        return -1;
+    }
+
+    struct readback rb = { .name = var };
+    struct var_parser parser;
+    var_parser_init(&parser, check_var, &rb);
+
+    /* Headers end somewhere in the first buffers; the body is the rest */
+    char buf[RX_BUFFER_SIZE];
+    int in_body = 0, matched = 0, n;
+    *parse_ns = 0;
+    *body_len = 0;
+
+    while((n = read(sock, buf, sizeof(buf))) > 0)
+    {
+        int start = 0;
+        if(!in_body)
+        {
+            static const char end[] = "\r\n\r\n";
+            while(start < n && matched < 4)
+            {
+                char c = buf[start++];
+                if(c == end[matched])
+                {
+                    matched++;
+                }
+                else
+                {
+                    matched = (c == '\r') ? 1 : 0;
+                }
+            }
+            if(matched < 4)
+            {
+                continue;
+            }
+            in_body = 1;
+        }
+
+        int64_t t_parse = now_ns();
+        var_parser_feed(&parser, buf + start, n - start);
+        *parse_ns += now_ns() - t_parse;
+        *body_len += n - start;
+    }
+    var_parser_finish(&parser);
+    close(sock);
+
+    *correct = rb.found && rb.value == value;
+    return now_ns() - t;
+}
+
+static int bench_main(const char *host, int count, int port)
+{
+    struct addrinfo hints = { .ai_family = AF_INET }, *res;
+    if(getaddrinfo(host, NULL, &hints, &res) != 0)
+    {
+        fprintf(stderr, "can't resolve %s\n", host);
+        return 1;
+    }
+
+    struct sockaddr_in dest = *(struct sockaddr_in *)res->ai_addr;
+    freeaddrinfo(res);
+    dest.sin_port = htons(port);
+
+    int64_t *lat = calloc(count, sizeof(*lat));
+    int64_t parse_total = 0;
+    long bytes_total = 0;
+    int n = 0, failed = 0, correct = 0, overrun = 0;
+
+    for(int i = 0; i < count; i++)
+    {
+        int64_t parse_ns;
+        int body_len, ok;
+
+        int64_t l = set_and_read(&dest, host, "bench", i, &parse_ns, &body_len, &ok);
+        if(l < 0)
+        {
+            failed++;
+            continue;
+        }
+
+        lat[n++] = l;
+        parse_total += parse_ns;
+        bytes_total += body_len;
+        correct += ok;
+        overrun += body_len >= OLD_BODY_BUFFER;
+    }
+
+    if(n == 0)
+    {
+        printf("no successful requests (%d failed)\n", failed);
+        free(lat);
+        return 1;
+    }
+
+    qsort(lat, n, sizeof(*lat), cmp_i64);
+
+    printf("n=%d failed=%d  round trip p50 %lld  p99 %lld  max %lld us\n",
+           n, failed,
+           (long long)lat[n / 2] / 1000, (long long)lat[(n * 99) / 100] / 1000,
+           (long long)lat[n - 1] / 1000);
+    printf("body %ld bytes avg, parsed at %.2f ns/byte (%lld ns per response)\n",
+           bytes_total / n,
+           bytes_total ? (double)parse_total / bytes_total : 0.0,
+           (long long)(parse_total / n));
+    printf("read back correctly: %d/%d\n", correct, n);
+    printf("would have overrun a %d byte body buffer: %d/%d\n", OLD_BODY_BUFFER, overrun, n);
+
+    free(lat);
+    return correct == n ? 0 : 2;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc >= 2 && !strcmp(argv[1], "serve"))
+    {
+        return serve_main(argc >= 3 ? atoi(argv[2]) : DEFAULT_PORT,
+                          argc >= 4 ? atoi(argv[3]) : 0);
+    }
+
+    if(argc >= 3 && !strcmp(argv[1], "bench"))
+    {
+        return bench_main(argv[2],
+                          argc >= 4 ? atoi(argv[3]) : 200,
+                          argc >= 5 ? atoi(argv[4]) : DEFAULT_PORT);
+    }
+
+    fprintf(stderr,
+            "usage: %s serve [port] [body_bytes]\n"
+            "       %s bench <host> [count] [port]\n",
+            argv[0], argv[0]);
+    return 1;
+}